@@ -19,6 +19,19 @@
 #include <libgen.h>
 #include <limits.h>
 #include <errno.h>
+#include <locale.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <getopt.h>
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
@@ -33,322 +46,4158 @@
 #define REVERSE "\033[7m"
 
 static int color_enabled = 0;
+static int stats_enabled = 0;
+static int du_enabled = 0;      /* --du: per-directory and grand totals */
+
+/* counters reported by --stats */
+static struct {
+    unsigned long dirs;
+    unsigned long entries;
+    unsigned long allocs;
+    unsigned long opens;      /* directory open() calls */
+    unsigned long getdents;   /* getdents64() calls */
+    unsigned long stats;      /* per-entry stat calls */
+    unsigned long readlinks;  /* readlink() calls */
+    unsigned long nss;        /* getpwuid()/getgrgid() calls */
+    unsigned long nss_hits;   /* owner/group names served from cache */
+    unsigned long cache_hits; /* directories served from --cache */
+    unsigned long pruned;     /* directories --diff found unchanged */
+} run_stats;
+
+#define STAT_ADD(field, v) __atomic_fetch_add(&run_stats.field, (v), __ATOMIC_RELAXED)
 
 /* ---------------- helpers ---------------- */
 
-int cmpstr_qsort(const void *a, const void *b) {
-    const char * const *sa = (const char * const *)a;
-    const char * const *sb = (const char * const *)b;
-    return strcmp(*sa, *sb);
+int get_term_width(void) {
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1) return 80;
+    return ws.ws_col ? ws.ws_col : 80;
+}
+
+typedef struct {
+    uint64_t dev, ino;
+} devino_t;
+
+/* slot of (dev, ino) in an open-addressing table of cap (a power of 2) */
+static size_t devino_hash(uint64_t dev, uint64_t ino, size_t cap) {
+    uint64_t h = (ino ^ (dev << 32 | dev >> 32)) * 0x9e3779b97f4a7c15ULL;
+    return (size_t)(h >> 32) & (cap - 1);
+}
+
+/* ---------------- output buffer ---------------- */
+
+/* All listing output is assembled here with hand-rolled formatting and
+ * written with few large writes instead of many small printf calls.
+ * Only the main thread writes to it. */
+#define OUTBUF_SIZE (64 * 1024)
+
+static struct {
+    char   buf[OUTBUF_SIZE];
+    size_t len;
+    int    failed;   /* a write failed; further output is dropped */
+    int    interactive;  /* stdout is a terminal: flush per directory */
+} out;
+
+/* write the buffer followed by extra (may be NULL), retrying short writes */
+void out_writev(const char *extra, size_t elen) {
+    struct iovec iov[2] = {
+        { out.buf, out.len },
+        { (void *)extra, extra ? elen : 0 },
+    };
+    struct iovec *v = iov;
+    int cnt = 2;
+    while (!out.failed && cnt > 0) {
+        if (v->iov_len == 0) { v++; cnt--; continue; }
+        ssize_t w = writev(STDOUT_FILENO, v, cnt);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            out.failed = 1;
+            break;
+        }
+        while (cnt > 0 && (size_t)w >= v->iov_len) { w -= v->iov_len; v++; cnt--; }
+        if (cnt > 0) {
+            v->iov_base = (char *)v->iov_base + w;
+            v->iov_len -= w;
+        }
+    }
+    out.len = 0;
+}
+
+void out_flush(void) {
+    if (out.len) out_writev(NULL, 0);
+}
+
+void out_write(const char *s, size_t n) {
+    if (out.len + n <= OUTBUF_SIZE) {
+        memcpy(out.buf + out.len, s, n);
+        out.len += n;
+    } else if (n >= OUTBUF_SIZE / 2) {
+        out_writev(s, n);   /* large chunk: one writev with the buffer */
+    } else {
+        out_flush();
+        memcpy(out.buf, s, n);
+        out.len = n;
+    }
+}
+
+void out_str(const char *s) {
+    out_write(s, strlen(s));
+}
+
+void out_char(char c) {
+    if (out.len == OUTBUF_SIZE) out_flush();
+    out.buf[out.len++] = c;
+}
+
+void out_spaces(int n) {
+    static const char spaces[] = "                                ";
+    while (n > 0) {
+        int k = n < (int)sizeof(spaces) - 1 ? n : (int)sizeof(spaces) - 1;
+        out_write(spaces, k);
+        n -= k;
+    }
+}
+
+/* decimal, right-aligned in width (like "%*lld") */
+void out_int(long long v, int width) {
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long long u = v < 0 ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+    do { *--p = (char)('0' + u % 10); u /= 10; } while (u);
+    if (v < 0) *--p = '-';
+    int len = (int)(tmp + sizeof(tmp) - p);
+    if (width > len) out_spaces(width - len);
+    out_write(p, len);
+}
+
+/* string, left-aligned in width (like "%-*s") */
+void out_str_left(const char *s, int width) {
+    size_t len = strlen(s);
+    out_write(s, len);
+    if (width > (int)len) out_spaces(width - (int)len);
+}
+
+/* report an error after the output written so far */
+void out_perror(const char *what) {
+    int err = errno;
+    out_flush();
+    errno = err;
+    perror(what);
+}
+
+/* ---------------- getdents64 directory reader ---------------- */
+
+/* Record layout filled in by getdents64(2). Declared here because older
+ * glibc has no wrapper and <dirent.h> does not expose it. */
+struct linux_dirent64 {
+    ino64_t        d_ino;
+    off64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+#define DIRBUF_DEFAULT (256 * 1024)
+#define DIRBUF_MIN     (32 * 1024)
+#define DIRBUF_MAX     (16 * 1024 * 1024)
+
+/* getdents64 buffer size, tunable through LS_DIRBUF (e.g. "1M", "512K") */
+static size_t dirbuf_size = DIRBUF_DEFAULT;
+
+/* One spare buffer per thread so walking many directories does not
+ * malloc/free a large block for each of them. */
+static __thread char *dirbuf_spare = NULL;
+
+typedef struct {
+    int   fd;
+    char *buf;
+    long  len;   /* bytes returned by the last getdents64 call */
+    long  pos;   /* offset of the next unread record in buf */
+} dirstream_t;
+
+/* parse "123", "64K", "1M" into bytes; returns 0 on malformed input */
+size_t parse_size(const char *s) {
+    if (!s || !*s) return 0;
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno || end == s) return 0;
+    switch (*end) {
+        case 'k': case 'K': v <<= 10; end++; break;
+        case 'm': case 'M': v <<= 20; end++; break;
+        case 'g': case 'G': v <<= 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0') return 0;
+    return (size_t)v;
+}
+
+void dirbuf_configure(void) {
+    size_t sz = parse_size(getenv("LS_DIRBUF"));
+    if (sz == 0) return;
+    if (sz < DIRBUF_MIN) sz = DIRBUF_MIN;
+    if (sz > DIRBUF_MAX) sz = DIRBUF_MAX;
+    dirbuf_size = sz;
+}
+
+/* free this thread's spare buffer; called when a worker thread exits */
+void dirbuf_release(void) {
+    free(dirbuf_spare);
+    dirbuf_spare = NULL;
+}
+
+/* read the already open directory fd; it is closed on failure */
+int ds_attach(dirstream_t *ds, int fd) {
+    ds->fd = fd;
+    if (dirbuf_spare) {
+        ds->buf = dirbuf_spare;
+        dirbuf_spare = NULL;
+    } else {
+        ds->buf = malloc(dirbuf_size);
+        if (!ds->buf) { close(ds->fd); ds->fd = -1; errno = ENOMEM; return -1; }
+    }
+    ds->len = ds->pos = 0;
+    return 0;
+}
+
+/* open name relative to dirfd (AT_FDCWD for plain paths) */
+int ds_openat(dirstream_t *ds, int dirfd, const char *name) {
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    STAT_ADD(opens, 1);
+    if (fd == -1) return -1;
+    return ds_attach(ds, fd);
+}
+
+/* Next entry other than . and .., parsed in place from the batch buffer.
+ * Returns NULL at end of directory (errno == 0) or on error (errno set).
+ * The record stays valid until the following ds_next()/ds_close(). */
+struct linux_dirent64 *ds_next(dirstream_t *ds) {
+    for (;;) {
+        if (ds->pos >= ds->len) {
+            long nread = syscall(SYS_getdents64, ds->fd, ds->buf, dirbuf_size);
+            STAT_ADD(getdents, 1);
+            if (nread <= 0) {
+                if (nread == 0) errno = 0;
+                return NULL;
+            }
+            ds->len = nread;
+            ds->pos = 0;
+        }
+        struct linux_dirent64 *d = (struct linux_dirent64 *)(ds->buf + ds->pos);
+        ds->pos += d->d_reclen;
+        const char *nm = d->d_name;
+        if (nm[0] == '.' && (nm[1] == '\0' || (nm[1] == '.' && nm[2] == '\0'))) continue;
+        return d;
+    }
+}
+
+void ds_close(dirstream_t *ds) {
+    if (ds->fd != -1) close(ds->fd);
+    if (!dirbuf_spare) dirbuf_spare = ds->buf;
+    else free(ds->buf);
+    ds->fd = -1;
+    ds->buf = NULL;
+}
+
+/* ---------------- display width ---------------- */
+
+/* Terminal columns a name occupies, computed once when it is added to a
+ * listing. Pure-ASCII names (checked eight bytes at a time) are as wide as
+ * they are long. Other names are decoded as UTF-8 and each code point is
+ * looked up in the range tables below, generated from Unicode 14.0:
+ * combining marks and format characters take no column, East Asian Wide and
+ * Fullwidth characters take two. A byte that does not start a valid UTF-8
+ * sequence counts as one column, as terminals show a replacement glyph. */
+struct wrange {
+    uint32_t lo, hi;
+};
+
+static const struct wrange zero_width[] = {
+    { 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd }, { 0x05bf, 0x05bf },
+    { 0x05c1, 0x05c2 }, { 0x05c4, 0x05c5 }, { 0x05c7, 0x05cf }, { 0x0600, 0x0605 },
+    { 0x0610, 0x061a }, { 0x061c, 0x061c }, { 0x064b, 0x065f }, { 0x0670, 0x0670 },
+    { 0x06d6, 0x06dd }, { 0x06df, 0x06e4 }, { 0x06e7, 0x06e8 }, { 0x06ea, 0x06ed },
+    { 0x070f, 0x070f }, { 0x0711, 0x0711 }, { 0x0730, 0x074c }, { 0x07a6, 0x07b0 },
+    { 0x07eb, 0x07f3 }, { 0x07fd, 0x07fd }, { 0x0816, 0x0819 }, { 0x081b, 0x0823 },
+    { 0x0825, 0x0827 }, { 0x0829, 0x082f }, { 0x0859, 0x085d }, { 0x0890, 0x089f },
+    { 0x08ca, 0x0902 }, { 0x093a, 0x093a }, { 0x093c, 0x093c }, { 0x0941, 0x0948 },
+    { 0x094d, 0x094d }, { 0x0951, 0x0957 }, { 0x0962, 0x0963 }, { 0x0981, 0x0981 },
+    { 0x09bc, 0x09bc }, { 0x09c1, 0x09c6 }, { 0x09cd, 0x09cd }, { 0x09e2, 0x09e5 },
+    { 0x09fe, 0x0a02 }, { 0x0a3c, 0x0a3d }, { 0x0a41, 0x0a58 }, { 0x0a70, 0x0a71 },
+    { 0x0a75, 0x0a75 }, { 0x0a81, 0x0a82 }, { 0x0abc, 0x0abc }, { 0x0ac1, 0x0ac8 },
+    { 0x0acd, 0x0acf }, { 0x0ae2, 0x0ae5 }, { 0x0afa, 0x0b01 }, { 0x0b3c, 0x0b3c },
+    { 0x0b3f, 0x0b3f }, { 0x0b41, 0x0b46 }, { 0x0b4d, 0x0b56 }, { 0x0b62, 0x0b65 },
+    { 0x0b82, 0x0b82 }, { 0x0bc0, 0x0bc0 }, { 0x0bcd, 0x0bcf }, { 0x0c00, 0x0c00 },
+    { 0x0c04, 0x0c04 }, { 0x0c3c, 0x0c3c }, { 0x0c3e, 0x0c40 }, { 0x0c46, 0x0c57 },
+    { 0x0c62, 0x0c65 }, { 0x0c81, 0x0c81 }, { 0x0cbc, 0x0cbc }, { 0x0cbf, 0x0cbf },
+    { 0x0cc6, 0x0cc6 }, { 0x0ccc, 0x0cd4 }, { 0x0ce2, 0x0ce5 }, { 0x0d00, 0x0d01 },
+    { 0x0d3b, 0x0d3c }, { 0x0d41, 0x0d45 }, { 0x0d4d, 0x0d4d }, { 0x0d62, 0x0d65 },
+    { 0x0d81, 0x0d81 }, { 0x0dca, 0x0dce }, { 0x0dd2, 0x0dd7 }, { 0x0e31, 0x0e31 },
+    { 0x0e34, 0x0e3e }, { 0x0e47, 0x0e4e }, { 0x0eb1, 0x0eb1 }, { 0x0eb4, 0x0ebc },
+    { 0x0ec8, 0x0ecf }, { 0x0f18, 0x0f19 }, { 0x0f35, 0x0f35 }, { 0x0f37, 0x0f37 },
+    { 0x0f39, 0x0f39 }, { 0x0f71, 0x0f7e }, { 0x0f80, 0x0f84 }, { 0x0f86, 0x0f87 },
+    { 0x0f8d, 0x0fbd }, { 0x0fc6, 0x0fc6 }, { 0x102d, 0x1030 }, { 0x1032, 0x1037 },
+    { 0x1039, 0x103a }, { 0x103d, 0x103e }, { 0x1058, 0x1059 }, { 0x105e, 0x1060 },
+    { 0x1071, 0x1074 }, { 0x1082, 0x1082 }, { 0x1085, 0x1086 }, { 0x108d, 0x108d },
+    { 0x109d, 0x109d }, { 0x1160, 0x11ff }, { 0x135d, 0x135f }, { 0x1712, 0x1714 },
+    { 0x1732, 0x1733 }, { 0x1752, 0x175f }, { 0x1772, 0x177f }, { 0x17b4, 0x17b5 },
+    { 0x17b7, 0x17bd }, { 0x17c6, 0x17c6 }, { 0x17c9, 0x17d3 }, { 0x17dd, 0x17df },
+    { 0x180b, 0x180f }, { 0x1885, 0x1886 }, { 0x18a9, 0x18a9 }, { 0x1920, 0x1922 },
+    { 0x1927, 0x1928 }, { 0x1932, 0x1932 }, { 0x1939, 0x193f }, { 0x1a17, 0x1a18 },
+    { 0x1a1b, 0x1a1d }, { 0x1a56, 0x1a56 }, { 0x1a58, 0x1a60 }, { 0x1a62, 0x1a62 },
+    { 0x1a65, 0x1a6c }, { 0x1a73, 0x1a7f }, { 0x1ab0, 0x1b03 }, { 0x1b34, 0x1b34 },
+    { 0x1b36, 0x1b3a }, { 0x1b3c, 0x1b3c }, { 0x1b42, 0x1b42 }, { 0x1b6b, 0x1b73 },
+    { 0x1b80, 0x1b81 }, { 0x1ba2, 0x1ba5 }, { 0x1ba8, 0x1ba9 }, { 0x1bab, 0x1bad },
+    { 0x1be6, 0x1be6 }, { 0x1be8, 0x1be9 }, { 0x1bed, 0x1bed }, { 0x1bef, 0x1bf1 },
+    { 0x1c2c, 0x1c33 }, { 0x1c36, 0x1c3a }, { 0x1cd0, 0x1cd2 }, { 0x1cd4, 0x1ce0 },
+    { 0x1ce2, 0x1ce8 }, { 0x1ced, 0x1ced }, { 0x1cf4, 0x1cf4 }, { 0x1cf8, 0x1cf9 },
+    { 0x1dc0, 0x1dff }, { 0x200b, 0x200f }, { 0x202a, 0x202e }, { 0x2060, 0x206f },
+    { 0x20d0, 0x20ff }, { 0x2cef, 0x2cf1 }, { 0x2d7f, 0x2d7f }, { 0x2de0, 0x2dff },
+    { 0x302a, 0x302d }, { 0x3099, 0x309a }, { 0xa66f, 0xa672 }, { 0xa674, 0xa67d },
+    { 0xa69e, 0xa69f }, { 0xa6f0, 0xa6f1 }, { 0xa802, 0xa802 }, { 0xa806, 0xa806 },
+    { 0xa80b, 0xa80b }, { 0xa825, 0xa826 }, { 0xa82c, 0xa82f }, { 0xa8c4, 0xa8cd },
+    { 0xa8e0, 0xa8f1 }, { 0xa8ff, 0xa8ff }, { 0xa926, 0xa92d }, { 0xa947, 0xa951 },
+    { 0xa980, 0xa982 }, { 0xa9b3, 0xa9b3 }, { 0xa9b6, 0xa9b9 }, { 0xa9bc, 0xa9bd },
+    { 0xa9e5, 0xa9e5 }, { 0xaa29, 0xaa2e }, { 0xaa31, 0xaa32 }, { 0xaa35, 0xaa3f },
+    { 0xaa43, 0xaa43 }, { 0xaa4c, 0xaa4c }, { 0xaa7c, 0xaa7c }, { 0xaab0, 0xaab0 },
+    { 0xaab2, 0xaab4 }, { 0xaab7, 0xaab8 }, { 0xaabe, 0xaabf }, { 0xaac1, 0xaac1 },
+    { 0xaaec, 0xaaed }, { 0xaaf6, 0xab00 }, { 0xabe5, 0xabe5 }, { 0xabe8, 0xabe8 },
+    { 0xabed, 0xabef }, { 0xfb1e, 0xfb1e }, { 0xfe00, 0xfe0f }, { 0xfe20, 0xfe2f },
+    { 0xfeff, 0xff00 }, { 0xfff9, 0xfffb }, { 0x101fd, 0x1027f }, { 0x102e0, 0x102e0 },
+    { 0x10376, 0x1037f }, { 0x10a01, 0x10a0f }, { 0x10a38, 0x10a3f }, { 0x10ae5, 0x10aea },
+    { 0x10d24, 0x10d2f }, { 0x10eab, 0x10eac }, { 0x10f46, 0x10f50 }, { 0x10f82, 0x10f85 },
+    { 0x11001, 0x11001 }, { 0x11038, 0x11046 }, { 0x11070, 0x11070 }, { 0x11073, 0x11074 },
+    { 0x1107f, 0x11081 }, { 0x110b3, 0x110b6 }, { 0x110b9, 0x110ba }, { 0x110bd, 0x110bd },
+    { 0x110c2, 0x110cf }, { 0x11100, 0x11102 }, { 0x11127, 0x1112b }, { 0x1112d, 0x11135 },
+    { 0x11173, 0x11173 }, { 0x11180, 0x11181 }, { 0x111b6, 0x111be }, { 0x111c9, 0x111cc },
+    { 0x111cf, 0x111cf }, { 0x1122f, 0x11231 }, { 0x11234, 0x11234 }, { 0x11236, 0x11237 },
+    { 0x1123e, 0x1127f }, { 0x112df, 0x112df }, { 0x112e3, 0x112ef }, { 0x11300, 0x11301 },
+    { 0x1133b, 0x1133c }, { 0x11340, 0x11340 }, { 0x11366, 0x113ff }, { 0x11438, 0x1143f },
+    { 0x11442, 0x11444 }, { 0x11446, 0x11446 }, { 0x1145e, 0x1145e }, { 0x114b3, 0x114b8 },
+    { 0x114ba, 0x114ba }, { 0x114bf, 0x114c0 }, { 0x114c2, 0x114c3 }, { 0x115b2, 0x115b7 },
+    { 0x115bc, 0x115bd }, { 0x115bf, 0x115c0 }, { 0x115dc, 0x115ff }, { 0x11633, 0x1163a },
+    { 0x1163d, 0x1163d }, { 0x1163f, 0x11640 }, { 0x116ab, 0x116ab }, { 0x116ad, 0x116ad },
+    { 0x116b0, 0x116b5 }, { 0x116b7, 0x116b7 }, { 0x1171d, 0x1171f }, { 0x11722, 0x11725 },
+    { 0x11727, 0x1172f }, { 0x1182f, 0x11837 }, { 0x11839, 0x1183a }, { 0x1193b, 0x1193c },
+    { 0x1193e, 0x1193e }, { 0x11943, 0x11943 }, { 0x119d4, 0x119db }, { 0x119e0, 0x119e0 },
+    { 0x11a01, 0x11a0a }, { 0x11a33, 0x11a38 }, { 0x11a3b, 0x11a3e }, { 0x11a47, 0x11a4f },
+    { 0x11a51, 0x11a56 }, { 0x11a59, 0x11a5b }, { 0x11a8a, 0x11a96 }, { 0x11a98, 0x11a99 },
+    { 0x11c30, 0x11c3d }, { 0x11c3f, 0x11c3f }, { 0x11c92, 0x11ca8 }, { 0x11caa, 0x11cb0 },
+    { 0x11cb2, 0x11cb3 }, { 0x11cb5, 0x11cff }, { 0x11d31, 0x11d45 }, { 0x11d47, 0x11d4f },
+    { 0x11d90, 0x11d92 }, { 0x11d95, 0x11d95 }, { 0x11d97, 0x11d97 }, { 0x11ef3, 0x11ef4 },
+    { 0x13430, 0x143ff }, { 0x16af0, 0x16af4 }, { 0x16b30, 0x16b36 }, { 0x16f4f, 0x16f4f },
+    { 0x16f8f, 0x16f92 }, { 0x16fe4, 0x16fef }, { 0x1bc9d, 0x1bc9e }, { 0x1bca0, 0x1cf4f },
+    { 0x1d167, 0x1d169 }, { 0x1d173, 0x1d182 }, { 0x1d185, 0x1d18b }, { 0x1d1aa, 0x1d1ad },
+    { 0x1d242, 0x1d244 }, { 0x1da00, 0x1da36 }, { 0x1da3b, 0x1da6c }, { 0x1da75, 0x1da75 },
+    { 0x1da84, 0x1da84 }, { 0x1da9b, 0x1deff }, { 0x1e000, 0x1e0ff }, { 0x1e130, 0x1e136 },
+    { 0x1e2ae, 0x1e2bf }, { 0x1e2ec, 0x1e2ef }, { 0x1e8d0, 0x1e8ff }, { 0x1e944, 0x1e94a },
+    { 0xe0001, 0xeffff },
+};
+static const struct wrange double_width[] = {
+    { 0x1100, 0x115f }, { 0x231a, 0x231b }, { 0x2329, 0x232a }, { 0x23e9, 0x23ec },
+    { 0x23f0, 0x23f0 }, { 0x23f3, 0x23f3 }, { 0x25fd, 0x25fe }, { 0x2614, 0x2615 },
+    { 0x2648, 0x2653 }, { 0x267f, 0x267f }, { 0x2693, 0x2693 }, { 0x26a1, 0x26a1 },
+    { 0x26aa, 0x26ab }, { 0x26bd, 0x26be }, { 0x26c4, 0x26c5 }, { 0x26ce, 0x26ce },
+    { 0x26d4, 0x26d4 }, { 0x26ea, 0x26ea }, { 0x26f2, 0x26f3 }, { 0x26f5, 0x26f5 },
+    { 0x26fa, 0x26fa }, { 0x26fd, 0x26fd }, { 0x2705, 0x2705 }, { 0x270a, 0x270b },
+    { 0x2728, 0x2728 }, { 0x274c, 0x274c }, { 0x274e, 0x274e }, { 0x2753, 0x2755 },
+    { 0x2757, 0x2757 }, { 0x2795, 0x2797 }, { 0x27b0, 0x27b0 }, { 0x27bf, 0x27bf },
+    { 0x2b1b, 0x2b1c }, { 0x2b50, 0x2b50 }, { 0x2b55, 0x2b55 }, { 0x2e80, 0x3029 },
+    { 0x302e, 0x303e }, { 0x3041, 0x3098 }, { 0x309b, 0x3247 }, { 0x3250, 0x4dbf },
+    { 0x4e00, 0xa4cf }, { 0xa960, 0xa97f }, { 0xac00, 0xd7af }, { 0xf900, 0xfaff },
+    { 0xfe10, 0xfe1f }, { 0xfe30, 0xfe6f }, { 0xff01, 0xff60 }, { 0xffe0, 0xffe7 },
+    { 0x16fe0, 0x16fe3 }, { 0x16ff0, 0x1bbff }, { 0x1f004, 0x1f004 }, { 0x1f0cf, 0x1f0d0 },
+    { 0x1f18e, 0x1f18e }, { 0x1f191, 0x1f19a }, { 0x1f200, 0x1f320 }, { 0x1f32d, 0x1f335 },
+    { 0x1f337, 0x1f37c }, { 0x1f37e, 0x1f393 }, { 0x1f3a0, 0x1f3ca }, { 0x1f3cf, 0x1f3d3 },
+    { 0x1f3e0, 0x1f3f0 }, { 0x1f3f4, 0x1f3f4 }, { 0x1f3f8, 0x1f43e }, { 0x1f440, 0x1f440 },
+    { 0x1f442, 0x1f4fc }, { 0x1f4ff, 0x1f53d }, { 0x1f54b, 0x1f54e }, { 0x1f550, 0x1f567 },
+    { 0x1f57a, 0x1f57a }, { 0x1f595, 0x1f596 }, { 0x1f5a4, 0x1f5a4 }, { 0x1f5fb, 0x1f64f },
+    { 0x1f680, 0x1f6c5 }, { 0x1f6cc, 0x1f6cc }, { 0x1f6d0, 0x1f6d2 }, { 0x1f6d5, 0x1f6df },
+    { 0x1f6eb, 0x1f6ef }, { 0x1f6f4, 0x1f6ff }, { 0x1f7e0, 0x1f7ff }, { 0x1f90c, 0x1f93a },
+    { 0x1f93c, 0x1f945 }, { 0x1f947, 0x1f9ff }, { 0x1fa70, 0x1faff }, { 0x20000, 0xe0000 },
+};
+
+static int in_ranges(const struct wrange *r, size_t n, uint32_t cp) {
+    size_t lo = 0, hi = n;
+    if (cp < r[0].lo || cp > r[n - 1].hi) return 0;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (cp > r[mid].hi) lo = mid + 1;
+        else if (cp < r[mid].lo) hi = mid;
+        else return 1;
+    }
+    return 0;
+}
+
+int codepoint_width(uint32_t cp) {
+    if (cp < 0x300) return 1;
+    if (in_ranges(zero_width, sizeof(zero_width) / sizeof(zero_width[0]), cp)) return 0;
+    if (in_ranges(double_width, sizeof(double_width) / sizeof(double_width[0]), cp)) return 2;
+    return 1;
+}
+
+int is_ascii(const char *s, size_t len) {
+    uint64_t acc = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, s + i, 8);
+        acc |= w;
+    }
+    for (; i < len; ++i) acc |= (unsigned char)s[i];
+    return (acc & 0x8080808080808080ULL) == 0;
+}
+
+/* decode one UTF-8 sequence; returns its length, or 0 if it is invalid */
+size_t utf8_decode(const unsigned char *s, size_t len, uint32_t *cp) {
+    unsigned char c = s[0];
+    size_t n;
+    uint32_t v, min;
+    if (c < 0x80) { *cp = c; return 1; }
+    else if ((c & 0xe0) == 0xc0) { n = 2; v = c & 0x1f; min = 0x80; }
+    else if ((c & 0xf0) == 0xe0) { n = 3; v = c & 0x0f; min = 0x800; }
+    else if ((c & 0xf8) == 0xf0) { n = 4; v = c & 0x07; min = 0x10000; }
+    else return 0;
+    if (n > len) return 0;
+    for (size_t i = 1; i < n; ++i) {
+        if ((s[i] & 0xc0) != 0x80) return 0;
+        v = (v << 6) | (s[i] & 0x3f);
+    }
+    if (v < min || v > 0x10ffff || (v >= 0xd800 && v <= 0xdfff)) return 0;
+    *cp = v;
+    return n;
+}
+
+size_t name_width(const char *name, size_t len) {
+    if (is_ascii(name, len)) return len;
+    const unsigned char *s = (const unsigned char *)name;
+    size_t width = 0;
+    for (size_t i = 0; i < len; ) {
+        uint32_t cp;
+        size_t n = utf8_decode(s + i, len - i, &cp);
+        if (n == 0) { width++; i++; continue; }
+        width += codepoint_width(cp);
+        i += n;
+    }
+    return width;
+}
+
+/* ---------------- directory listing ---------------- */
+
+/* One record per directory entry. Names of a directory are stored back to
+ * back (NUL-terminated) in a single slab and referenced by offset, so the
+ * slab can grow by realloc and the listing is released with a few frees.
+ * Metadata lives in a separate array indexed by slot (read order). It is
+ * fetched lazily, at most once per entry, relative to the directory fd the
+ * listing keeps open, and the array itself is only allocated on first use so
+ * sorting still moves 16-byte records rather than whole struct stats. */
+typedef struct {
+    uint32_t      off;    /* name offset in the slab */
+    uint32_t      len;    /* name length in bytes */
+    uint32_t      slot;   /* index into listing_t.st */
+    unsigned char type;   /* DT_* from getdents64, filled from st_mode if DT_UNKNOWN */
+    unsigned char flags;  /* ENT_* */
+    uint16_t      width;  /* display columns of the name */
+} entry_t;
+
+#define ENT_HAVE_STAT   0x01
+#define ENT_STAT_FAILED 0x02   /* the slot's st_blksize holds the errno */
+#define ENT_SLOT_USED   (ENT_HAVE_STAT | ENT_STAT_FAILED)
+
+typedef struct {
+    char        *slab;
+    size_t       used, cap;
+    entry_t     *ents;
+    int          n, ecap;
+    size_t       garbage; /* slab bytes of names dropped by --head */
+    struct stat *st;      /* per-slot metadata, allocated on first stat */
+    size_t       st_cap;
+    int          dirfd;   /* open directory, -1 once released */
+    int          remote;  /* -1 unknown, else whether dirfd is on a network fs */
+    int          mapped;  /* slab, ents and st point into the --cache file */
+    struct stat *dirst;   /* the directory's own fstat(), kept for --cache */
+    const char **links;   /* per-slot symlink targets of a --snapshot listing */
+} listing_t;
+
+#define ENT_NAME(ls, e)  ((ls)->slab + (e)->off)
+#define ENT_STAT(ls, e)  (&(ls)->st[(e)->slot])
+
+void listing_init(listing_t *ls) {
+    memset(ls, 0, sizeof(*ls));
+    ls->dirfd = -1;
+    ls->remote = -1;
+}
+
+/* close the directory fd; entries not yet stat'ed can no longer be */
+void listing_release_dir(listing_t *ls) {
+    if (ls->dirfd != -1) close(ls->dirfd);
+    ls->dirfd = -1;
+}
+
+void listing_free(listing_t *ls) {
+    listing_release_dir(ls);
+    if (!ls->mapped) {
+        free(ls->slab);
+        free(ls->ents);
+        free(ls->st);
+    }
+    free(ls->dirst);
+    free(ls->links);
+    listing_init(ls);
+}
+
+int listing_add(listing_t *ls, const char *name, size_t len, unsigned char type) {
+    if (ls->used + len + 1 > ls->cap) {
+        size_t cap = ls->cap ? ls->cap : 16384;
+        while (ls->used + len + 1 > cap) cap *= 2;
+        if (cap > UINT32_MAX) { errno = EOVERFLOW; return -1; }
+        char *tmp = realloc(ls->slab, cap);
+        if (!tmp) return -1;
+        STAT_ADD(allocs, 1);
+        ls->slab = tmp;
+        ls->cap = cap;
+    }
+    if (ls->n >= ls->ecap) {
+        int ecap = ls->ecap ? ls->ecap * 2 : 256;
+        entry_t *tmp = realloc(ls->ents, sizeof(entry_t) * ecap);
+        if (!tmp) return -1;
+        STAT_ADD(allocs, 1);
+        ls->ents = tmp;
+        ls->ecap = ecap;
+    }
+    memcpy(ls->slab + ls->used, name, len + 1);
+    entry_t *e = &ls->ents[ls->n];
+    e->off = (uint32_t)ls->used;
+    e->len = (uint32_t)len;
+    e->slot = (uint32_t)ls->n;
+    e->type = type;
+    e->flags = 0;
+    e->width = (uint16_t)name_width(name, len);
+    ls->used += len + 1;
+    ls->n++;
+    return 0;
+}
+
+/* ---------------- metadata fetch ---------------- */
+
+/* statx() fields the active display mode needs; set once in main() so
+ * plain colored listings only ask the filesystem for type and mode. */
+static unsigned int meta_mask = STATX_TYPE | STATX_MODE;
+static int statx_unavailable = 0;
+static int meta_all = 0;   /* stat every entry whatever the mode needs */
+
+/* Network filesystems where a forced attribute revalidation costs a round
+ * trip; there we let statx() answer from the client's attribute cache. */
+int fd_is_remote(int fd) {
+    struct statfs sfs;
+    if (fstatfs(fd, &sfs) == -1) return 0;
+    switch ((unsigned long)sfs.f_type) {
+        case NFS_SUPER_MAGIC:
+        case SMB_SUPER_MAGIC:
+        case SMB2_SUPER_MAGIC:
+        case CIFS_SUPER_MAGIC:
+        case CEPH_SUPER_MAGIC:
+        case AFS_SUPER_MAGIC:
+        case V9FS_MAGIC:
+        case FUSE_SUPER_MAGIC:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* copy the fields statx() filled in; the rest stay zero */
+void statx_to_stat(const struct statx *sx, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_mode    = sx->stx_mode;
+    st->st_ino     = sx->stx_ino;
+    st->st_dev     = makedev(sx->stx_dev_major, sx->stx_dev_minor);
+    st->st_rdev    = makedev(sx->stx_rdev_major, sx->stx_rdev_minor);
+    st->st_nlink   = sx->stx_nlink;
+    st->st_uid     = sx->stx_uid;
+    st->st_gid     = sx->stx_gid;
+    st->st_size    = sx->stx_size;
+    st->st_blksize = sx->stx_blksize;
+    st->st_blocks  = sx->stx_blocks;
+    st->st_atim.tv_sec  = sx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = sx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec  = sx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = sx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec  = sx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = sx->stx_ctime.tv_nsec;
+}
+
+/* lstat-equivalent of name in dirfd limited to meta_mask, falling back to
+ * fstatat() on kernels without statx() */
+int fetch_meta(int dirfd, const char *name, int remote, struct stat *st) {
+    STAT_ADD(stats, 1);
+    if (!statx_unavailable) {
+        struct statx sx;
+        int flags = AT_SYMLINK_NOFOLLOW | (remote ? AT_STATX_DONT_SYNC : 0);
+        if (statx(dirfd, name, flags, meta_mask, &sx) == 0) {
+            statx_to_stat(&sx, st);
+            return 0;
+        }
+        if (errno != ENOSYS) return -1;
+        statx_unavailable = 1;
+    }
+    return fstatat(dirfd, name, st, AT_SYMLINK_NOFOLLOW);
+}
+
+/* make room in ls->st for slot: all entries at once, or doubling while
+ * --head is still filling a listing, never past what it holds */
+int listing_st_reserve(listing_t *ls, uint32_t slot) {
+    if (slot < ls->st_cap) return 0;
+    size_t cap = ls->st_cap && ls->st_cap * 2 < (size_t)ls->n ? ls->st_cap * 2 : (size_t)ls->n;
+    if (cap <= slot) cap = (size_t)slot + 1;
+    struct stat *tmp = realloc(ls->st, sizeof(struct stat) * cap);
+    if (!tmp) return -1;
+    STAT_ADD(allocs, 1);
+    ls->st = tmp;
+    ls->st_cap = cap;
+    return 0;
+}
+
+/* record the outcome of fetching e's metadata into its slot: err is 0 or
+ * the errno of the failed fetch, kept for reporting it later */
+void entry_meta_done(listing_t *ls, entry_t *e, int err) {
+    if (err) {
+        ENT_STAT(ls, e)->st_blksize = err;
+        e->flags |= ENT_STAT_FAILED;
+        return;
+    }
+    e->flags |= ENT_HAVE_STAT;
+    if (e->type == DT_UNKNOWN) e->type = IFTODT(ENT_STAT(ls, e)->st_mode);
+}
+
+/* metadata for e, fetched on first use and cached; NULL with errno set
+ * on failure, the fetch's own errno if it failed earlier */
+const struct stat *entry_stat(listing_t *ls, entry_t *e) {
+    if (e->flags & ENT_HAVE_STAT) return ENT_STAT(ls, e);
+    if (e->flags & ENT_STAT_FAILED) {
+        errno = (int)ENT_STAT(ls, e)->st_blksize;
+        if (!errno) errno = EIO;
+        return NULL;
+    }
+    if (ls->dirfd == -1) { errno = EBADF; return NULL; }
+    if (listing_st_reserve(ls, e->slot) == -1) return NULL;
+    if (ls->remote == -1) ls->remote = fd_is_remote(ls->dirfd);
+    if (fetch_meta(ls->dirfd, ENT_NAME(ls, e), ls->remote, ENT_STAT(ls, e)) == -1) {
+        int err = errno;
+        entry_meta_done(ls, e, err);
+        errno = err;
+        return NULL;
+    }
+    entry_meta_done(ls, e, 0);
+    return ENT_STAT(ls, e);
+}
+
+/* ---------------- batched metadata fetch ---------------- */
+
+/* When a listing needs metadata for many entries (-l, -S, -t, colors), the
+ * requests can be issued as one batch instead of one synchronous statx() at
+ * a time: through a per-thread io_uring when the kernel offers one, else
+ * spread over a pool of helper threads. Completions arrive in any order
+ * and land in each entry's slot, so the renderer still reads them in
+ * sorted order. On a local file system a statx() is a cache hit and the
+ * hand-off costs more than it saves, so by default only directories on
+ * network file systems are batched; LS_METAFETCH=uring|threads|sync
+ * overrides the choice. */
+enum { FETCH_AUTO = 0, FETCH_URING, FETCH_THREADS, FETCH_SYNC };
+static int fetch_policy = FETCH_AUTO;
+
+#define RING_ENTRIES      256
+#define FETCH_MIN         8    /* smaller batches are fetched inline */
+#define FETCH_THREADS_MAX 16
+
+typedef struct {
+    int                  fd;   /* -1 not set up yet, -2 unavailable */
+    unsigned            *sq_tail, *sq_mask, *sq_array;
+    unsigned            *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void                *sq_map, *cq_map;
+    size_t               sq_len, cq_len, sqe_len;
+    unsigned             entries;
+} uring_t;
+
+static __thread uring_t ring = { .fd = -1, .sq_map = MAP_FAILED, .cq_map = MAP_FAILED,
+                                 .sqes = MAP_FAILED };
+
+void fetch_configure(void) {
+    const char *s = getenv("LS_METAFETCH");
+    if (!s) return;
+    if (strcmp(s, "uring") == 0) fetch_policy = FETCH_URING;
+    else if (strcmp(s, "threads") == 0) fetch_policy = FETCH_THREADS;
+    else if (strcmp(s, "sync") == 0) fetch_policy = FETCH_SYNC;
+}
+
+/* unmap and close this thread's ring; called when a worker thread exits */
+void uring_release(void) {
+    if (ring.sqes != MAP_FAILED) munmap(ring.sqes, ring.sqe_len);
+    if (ring.cq_map != MAP_FAILED && ring.cq_map != ring.sq_map) munmap(ring.cq_map, ring.cq_len);
+    if (ring.sq_map != MAP_FAILED) munmap(ring.sq_map, ring.sq_len);
+    if (ring.fd >= 0) close(ring.fd);
+    ring.sq_map = ring.cq_map = ring.sqes = MAP_FAILED;
+    ring.fd = -1;
+}
+
+int uring_setup(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring.fd = (int)syscall(SYS_io_uring_setup, RING_ENTRIES, &p);
+    if (ring.fd == -1) return -1;
+    ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sqe_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && ring.cq_len > ring.sq_len) ring.sq_len = ring.cq_len;
+
+    ring.sq_map = mmap(NULL, ring.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_map == MAP_FAILED) goto fail;
+    if (single) {
+        ring.cq_map = ring.sq_map;
+    } else {
+        ring.cq_map = mmap(NULL, ring.cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cq_map == MAP_FAILED) goto fail;
+    }
+    ring.sqes = mmap(NULL, ring.sqe_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) goto fail;
+
+    char *sq = ring.sq_map, *cq = ring.cq_map;
+    ring.sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.cq_head  = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+    ring.cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring.entries  = p.sq_entries;
+    return 0;
+
+fail:
+    uring_release();
+    return -1;
+}
+
+/* statx every entry of idx[0..n) through the ring, a ring's worth at a
+ * time; -1 if io_uring (or its statx opcode) is unavailable */
+int fetch_uring(listing_t *ls, const uint32_t *idx, size_t n) {
+    if (ring.fd == -2) return -1;
+    if (ring.fd == -1 && uring_setup() == -1) { ring.fd = -2; return -1; }
+    struct statx *bufs = malloc(sizeof(struct statx) * ring.entries);
+    if (!bufs) return -1;
+    int flags = AT_SYMLINK_NOFOLLOW | (ls->remote ? AT_STATX_DONT_SYNC : 0);
+
+    for (size_t next = 0; next < n; ) {
+        unsigned k = n - next < ring.entries ? (unsigned)(n - next) : ring.entries;
+        unsigned tail = *ring.sq_tail;
+        for (unsigned j = 0; j < k; ++j) {
+            unsigned si = (tail + j) & *ring.sq_mask;
+            struct io_uring_sqe *sqe = &ring.sqes[si];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = ls->dirfd;
+            sqe->addr = (uint64_t)(uintptr_t)ENT_NAME(ls, &ls->ents[idx[next + j]]);
+            sqe->len = meta_mask;
+            sqe->off = (uint64_t)(uintptr_t)&bufs[j];
+            sqe->statx_flags = (uint32_t)flags;
+            sqe->user_data = j;
+            ring.sq_array[si] = si;
+        }
+        __atomic_store_n(ring.sq_tail, tail + k, __ATOMIC_RELEASE);
+        STAT_ADD(stats, k);
+
+        unsigned submitted = 0, got = 0;
+        int unsupported = 0;
+        while (got < k) {
+            long ret = syscall(SYS_io_uring_enter, ring.fd, k - submitted, 1,
+                               IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret == -1) {
+                if (errno == EINTR) continue;
+                /* requests may still be in flight and write into bufs:
+                 * give up on the ring for good and leave bufs allocated */
+                ring.fd = -2;
+                return -1;
+            }
+            submitted += (unsigned)ret;
+            unsigned head = *ring.cq_head;
+            unsigned ctail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != ctail; ++head, ++got) {
+                struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+                unsigned j = (unsigned)cqe->user_data;
+                entry_t *e = &ls->ents[idx[next + j]];
+                if (cqe->res == -EINVAL) {
+                    unsupported = 1;   /* kernel without IORING_OP_STATX */
+                } else {
+                    if (cqe->res == 0) statx_to_stat(&bufs[j], ENT_STAT(ls, e));
+                    entry_meta_done(ls, e, -cqe->res);
+                }
+            }
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        }
+        next += k;
+        if (unsupported) {
+            uring_release();
+            ring.fd = -2;
+            free(bufs);
+            return -1;
+        }
+    }
+    free(bufs);
+    return 0;
+}
+
+/* A batch posted to the fetch helpers. Entries are claimed FETCH_MIN at a
+ * time through next; the poster claims too and waits until all are done
+ * and no helper still refers to the job. */
+typedef struct fetch_job {
+    listing_t        *ls;
+    const uint32_t   *idx;
+    size_t            n;
+    size_t            next;    /* atomic */
+    size_t            done;    /* the rest are guarded by fetch_pool.lock */
+    int               users;
+    struct fetch_job *link;    /* posted jobs with entries left to claim */
+} fetch_job_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  work, done;
+    fetch_job_t    *jobs;
+    int             nthreads;  /* helpers running; -1 if none could start */
+} fetch_pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER,
+                 .done = PTHREAD_COND_INITIALIZER };
+
+/* take job off the posted list; called with fetch_pool.lock held */
+void fetch_unpost(fetch_job_t *job) {
+    for (fetch_job_t **pp = &fetch_pool.jobs; *pp; pp = &(*pp)->link)
+        if (*pp == job) { *pp = job->link; break; }
+}
+
+/* statx claimed chunks of job until none are left */
+void fetch_run(fetch_job_t *job) {
+    for (;;) {
+        size_t i = __atomic_fetch_add(&job->next, FETCH_MIN, __ATOMIC_RELAXED);
+        if (i >= job->n) break;
+        size_t end = i + FETCH_MIN < job->n ? i + FETCH_MIN : job->n;
+        for (size_t j = i; j < end; ++j)
+            entry_stat(job->ls, &job->ls->ents[job->idx[j]]);
+        pthread_mutex_lock(&fetch_pool.lock);
+        job->done += end - i;
+        if (job->done == job->n) pthread_cond_broadcast(&fetch_pool.done);
+        pthread_mutex_unlock(&fetch_pool.lock);
+    }
+}
+
+void *fetch_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&fetch_pool.lock);
+    for (;;) {
+        while (!fetch_pool.jobs) pthread_cond_wait(&fetch_pool.work, &fetch_pool.lock);
+        fetch_job_t *job = fetch_pool.jobs;
+        job->users++;
+        pthread_mutex_unlock(&fetch_pool.lock);
+        fetch_run(job);
+        pthread_mutex_lock(&fetch_pool.lock);
+        fetch_unpost(job);
+        if (--job->users == 0) pthread_cond_broadcast(&fetch_pool.done);
+    }
+    return NULL;
+}
+
+/* statx idx[0..n) with this thread and up to FETCH_THREADS_MAX - 1
+ * helpers, which are started on first use and shared by all callers */
+int fetch_threads(listing_t *ls, const uint32_t *idx, size_t n) {
+    if (n < 2 * FETCH_MIN) return -1;
+    pthread_mutex_lock(&fetch_pool.lock);
+    if (fetch_pool.nthreads == 0) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        for (int t = 1; t < FETCH_THREADS_MAX; ++t, ++fetch_pool.nthreads) {
+            pthread_t tid;
+            if (pthread_create(&tid, &attr, fetch_worker, NULL) != 0) break;
+        }
+        pthread_attr_destroy(&attr);
+        if (fetch_pool.nthreads == 0) fetch_pool.nthreads = -1;
+    }
+    if (fetch_pool.nthreads == -1) {
+        pthread_mutex_unlock(&fetch_pool.lock);
+        return -1;
+    }
+    fetch_job_t job = { ls, idx, n, 0, 0, 0, fetch_pool.jobs };
+    fetch_pool.jobs = &job;
+    pthread_cond_broadcast(&fetch_pool.work);
+    pthread_mutex_unlock(&fetch_pool.lock);
+
+    fetch_run(&job);
+    pthread_mutex_lock(&fetch_pool.lock);
+    fetch_unpost(&job);
+    while (job.done < n || job.users > 0)
+        pthread_cond_wait(&fetch_pool.done, &fetch_pool.lock);
+    pthread_mutex_unlock(&fetch_pool.lock);
+    return 0;
+}
+
+/* Fetch metadata for ls->ents[idx[0..n)], none of which has it yet */
+void listing_fetch_batch(listing_t *ls, const uint32_t *idx, size_t n) {
+    if (n == 0 || ls->dirfd == -1) return;
+    if (ls->remote == -1) ls->remote = fd_is_remote(ls->dirfd);
+    int policy = fetch_policy;
+    if (policy == FETCH_AUTO) policy = ls->remote ? FETCH_URING : FETCH_SYNC;
+    if (n < FETCH_MIN || statx_unavailable) policy = FETCH_SYNC;
+
+    uint32_t maxslot = 0;
+    for (size_t i = 0; i < n; ++i)
+        if (ls->ents[idx[i]].slot > maxslot) maxslot = ls->ents[idx[i]].slot;
+    if (listing_st_reserve(ls, maxslot) == -1) policy = FETCH_SYNC;
+
+    if (policy == FETCH_URING && fetch_uring(ls, idx, n) == 0) policy = FETCH_SYNC;
+    if (policy != FETCH_SYNC) fetch_threads(ls, idx, n);
+    /* whatever is left (or everything, inline) */
+    for (size_t i = 0; i < n; ++i) entry_stat(ls, &ls->ents[idx[i]]);
+}
+
+/* ---------------- sort engine ---------------- */
+
+/* Names are sorted as byte strings (strcmp order) by an MSD radix sort over
+ * (8-byte key, index) pairs. Each level loads the next 8 bytes of every
+ * name once, orders the pairs with LSD byte passes (skipping bytes that
+ * are the same everywhere, e.g. a shared "file_" prefix), and only runs
+ * that tie on all 8 bytes go one level deeper. With --collate the strings
+ * sorted are strxfrm() images of the names, so locale collation costs one
+ * transform per name instead of one strcoll() per comparison.
+ *
+ * -S and -t sort on integer keys taken from the cached metadata (each
+ * entry is stat'ed once, before sorting) with the same radix passes; ties
+ * fall back to the name order. -r reverses the final order. */
+typedef struct {
+    uint64_t key;
+    uint32_t idx;
+} sortpair_t;
+
+typedef struct {
+    const unsigned char *str;
+    uint32_t             len;
+} sortstr_t;
+
+#define SORT_SMALL 48     /* below this, insertion sort beats radix passes */
+
+enum { SORT_NAME = 0, SORT_SIZE, SORT_TIME, SORT_NONE };
+
+static int collate_enabled = 0;
+static int sort_by = SORT_NAME;
+static int sort_reverse = 0;
+
+static uint64_t key_at(const sortstr_t *s, uint32_t depth) {
+    uint64_t k = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (depth + 8 <= s->len) {
+        memcpy(&k, s->str + depth, 8);
+        return __builtin_bswap64(k);
+    }
+#endif
+    for (uint32_t i = 0; i < 8; ++i) {
+        k <<= 8;
+        if (depth + i < s->len) k |= s->str[depth + i];
+    }
+    return k;
+}
+
+void radix_pairs(sortpair_t *a, sortpair_t *tmp, size_t n) {
+    sortpair_t *src = a, *dst = tmp;
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t count[256] = { 0 };
+        for (size_t i = 0; i < n; ++i) count[(src[i].key >> shift) & 0xff]++;
+        if (count[(src[0].key >> shift) & 0xff] == n) continue;
+        size_t sum = 0;
+        for (int b = 0; b < 256; ++b) { size_t c = count[b]; count[b] = sum; sum += c; }
+        for (size_t i = 0; i < n; ++i) dst[count[(src[i].key >> shift) & 0xff]++] = src[i];
+        sortpair_t *t = src; src = dst; dst = t;
+    }
+    if (src != a) memcpy(a, src, sizeof(sortpair_t) * n);
+}
+
+void insertion_pairs(sortpair_t *a, size_t n) {
+    for (size_t i = 1; i < n; ++i) {
+        sortpair_t v = a[i];
+        size_t j = i;
+        while (j > 0 && a[j - 1].key > v.key) { a[j] = a[j - 1]; j--; }
+        a[j] = v;
+    }
+}
+
+void sort_level(sortpair_t *a, sortpair_t *tmp, size_t n, const sortstr_t *strs, uint32_t depth) {
+    for (size_t i = 0; i < n; ++i) a[i].key = key_at(&strs[a[i].idx], depth);
+    if (n < SORT_SMALL) insertion_pairs(a, n);
+    else radix_pairs(a, tmp, n);
+
+    /* a zero low byte means the strings ended inside this key */
+    for (size_t i = 0; i < n; ) {
+        size_t j = i + 1;
+        while (j < n && a[j].key == a[i].key) j++;
+        if (j - i > 1 && (a[i].key & 0xff) != 0)
+            sort_level(a + i, tmp, j - i, strs, depth + 8);
+        i = j;
+    }
+}
+
+/* Sort pairs[0..n) (idx filled in) by the strings they index */
+void sort_strings(sortpair_t *pairs, sortpair_t *tmp, size_t n, const sortstr_t *strs) {
+    if (n > 1) sort_level(pairs, tmp, n, strs, 0);
+}
+
+void sort_keys(sortpair_t *a, sortpair_t *tmp, size_t n) {
+    if (n < SORT_SMALL) insertion_pairs(a, n);
+    else radix_pairs(a, tmp, n);
+}
+
+/* Larger sizes and newer times first: store the complement so ascending
+ * radix order yields descending values. Signed seconds are biased so
+ * times before 1970 order correctly. */
+uint64_t meta_key(const struct stat *st, int nsec) {
+    if (!st) return UINT64_MAX;   /* unstat'able entries go last */
+    if (sort_by == SORT_SIZE) return ~(uint64_t)st->st_size;
+    if (nsec) return ~(uint64_t)st->st_mtim.tv_nsec;
+    return ~((uint64_t)st->st_mtim.tv_sec ^ (1ULL << 63));
+}
+
+/* Order pairs by size or mtime (then nanoseconds), leaving runs that tie
+ * on the metadata to be ordered by name */
+void sort_by_meta(listing_t *ls, sortpair_t *pairs, sortpair_t *tmp, size_t n,
+                  const sortstr_t *strs) {
+    for (size_t i = 0; i < n; ++i) {
+        entry_t *e = &ls->ents[pairs[i].idx];
+        pairs[i].key = meta_key(entry_stat(ls, e), 0);
+    }
+    sort_keys(pairs, tmp, n);
+    for (size_t i = 0; i < n; ) {
+        size_t j = i + 1;
+        while (j < n && pairs[j].key == pairs[i].key) j++;
+        if (j - i > 1) {
+            if (sort_by == SORT_TIME) {
+                for (size_t k = i; k < j; ++k)
+                    pairs[k].key = meta_key(entry_stat(ls, &ls->ents[pairs[k].idx]), 1);
+                sort_keys(pairs + i, tmp, j - i);
+                for (size_t x = i; x < j; ) {
+                    size_t y = x + 1;
+                    while (y < j && pairs[y].key == pairs[x].key) y++;
+                    sort_strings(pairs + x, tmp, y - x, strs);
+                    x = y;
+                }
+            } else {
+                sort_strings(pairs + i, tmp, j - i, strs);
+            }
+        }
+        i = j;
+    }
+}
+
+/* strxfrm() images of every name, back to back in one buffer */
+char *collate_keys(const listing_t *ls, sortstr_t *strs) {
+    size_t cap = ls->used * 4 + 64, used = 0;
+    char *buf = malloc(cap);
+    if (!buf) return NULL;
+    size_t *offs = malloc(sizeof(size_t) * ls->n);
+    if (!offs) { free(buf); return NULL; }
+    for (int i = 0; i < ls->n; ++i) {
+        const char *name = ENT_NAME(ls, &ls->ents[i]);
+        size_t need = strxfrm(buf + used, name, cap - used);
+        if (need >= cap - used) {
+            while (need >= cap - used) cap *= 2;
+            char *tmp = realloc(buf, cap);
+            if (!tmp) { free(buf); free(offs); return NULL; }
+            buf = tmp;
+            strxfrm(buf + used, name, cap - used);
+        }
+        offs[i] = used;
+        strs[i].len = (uint32_t)need;
+        used += need + 1;
+    }
+    for (int i = 0; i < ls->n; ++i) strs[i].str = (const unsigned char *)buf + offs[i];
+    free(offs);
+    return buf;
+}
+
+/* Reorder ls->ents to follow pairs[].idx */
+int listing_permute(listing_t *ls, const sortpair_t *pairs) {
+    entry_t *ents = malloc(sizeof(entry_t) * ls->n);
+    if (!ents) return -1;
+    for (int i = 0; i < ls->n; ++i) ents[i] = ls->ents[pairs[i].idx];
+    memcpy(ls->ents, ents, sizeof(entry_t) * ls->n);
+    free(ents);
+    return 0;
+}
+
+int cmpent_qsort(const void *a, const void *b, void *slab) {
+    const entry_t *ea = a, *eb = b;
+    return strcmp((const char *)slab + ea->off, (const char *)slab + eb->off);
+}
+
+void listing_sort(listing_t *ls) {
+    if (ls->n < 2 || sort_by == SORT_NONE) return;
+    size_t n = (size_t)ls->n;
+    sortpair_t *pairs = malloc(sizeof(sortpair_t) * n * 2);
+    sortstr_t *strs = malloc(sizeof(sortstr_t) * n);
+    char *xfrm = NULL;
+    if (pairs && strs && collate_enabled) xfrm = collate_keys(ls, strs);
+    if (!pairs || !strs || (collate_enabled && !xfrm)) {
+        /* out of memory for the engine: plain qsort needs nothing extra */
+        free(pairs);
+        free(strs);
+        qsort_r(ls->ents, ls->n, sizeof(entry_t), cmpent_qsort, ls->slab);
+        return;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        pairs[i].idx = (uint32_t)i;
+        if (!xfrm) {
+            strs[i].str = (const unsigned char *)ENT_NAME(ls, &ls->ents[i]);
+            strs[i].len = ls->ents[i].len;
+        }
+    }
+    if (sort_by != SORT_NAME) sort_by_meta(ls, pairs, pairs + n, n, strs);
+    else sort_strings(pairs, pairs + n, n, strs);
+    if (xfrm && sort_by == SORT_NAME) {
+        /* names that collate equal keep a deterministic byte order */
+        for (size_t i = 0; i < n; ) {
+            const sortstr_t *k = &strs[pairs[i].idx];
+            size_t j = i + 1;
+            while (j < n && strs[pairs[j].idx].len == k->len &&
+                   memcmp(strs[pairs[j].idx].str, k->str, k->len) == 0) j++;
+            for (size_t x = i + 1; x < j; ++x) {
+                sortpair_t v = pairs[x];
+                size_t y = x;
+                while (y > i && strcmp(ENT_NAME(ls, &ls->ents[pairs[y - 1].idx]),
+                                       ENT_NAME(ls, &ls->ents[v.idx])) > 0) {
+                    pairs[y] = pairs[y - 1];
+                    y--;
+                }
+                pairs[y] = v;
+            }
+            i = j;
+        }
+    }
+    if (sort_reverse) {
+        for (size_t i = 0, j = n - 1; i < j; ++i, --j) {
+            sortpair_t t = pairs[i]; pairs[i] = pairs[j]; pairs[j] = t;
+        }
+    }
+    if (listing_permute(ls, pairs) == -1)
+        qsort_r(ls->ents, ls->n, sizeof(entry_t), cmpent_qsort, ls->slab);
+    free(xfrm);
+    free(strs);
+    free(pairs);
+}
+
+/* ---------------- top-K selection ---------------- */
+
+/* --head=N keeps only the first N entries of the sort order while the
+ * directory is being read: the listing is a max-heap whose root is the
+ * entry that would be printed last, so each new entry costs one
+ * comparison against the root and O(log N) when it displaces it. Names
+ * of evicted entries are reclaimed by compacting the slab, so memory
+ * stays O(N) however large the directory is. */
+static size_t head_limit = 0;   /* 0: keep everything */
+
+/* <0 if name na (metadata sa) is listed before nb (sb) in the active sort
+ * order; the metadata is only looked at for -S and -t */
+int sort_cmp(const char *na, const struct stat *sa, const char *nb, const struct stat *sb) {
+    int c = 0;
+    if (sort_by != SORT_NAME) {
+        for (int nsec = 0; nsec <= (sort_by == SORT_TIME) && c == 0; ++nsec) {
+            uint64_t ka = meta_key(sa, nsec), kb = meta_key(sb, nsec);
+            c = (ka > kb) - (ka < kb);
+        }
+    }
+    if (c == 0) {
+        c = collate_enabled ? strcoll(na, nb) : 0;
+        if (c == 0) c = strcmp(na, nb);
+    }
+    return sort_reverse ? -c : c;
+}
+
+int entry_cmp(listing_t *ls, entry_t *a, entry_t *b) {
+    const struct stat *sa = NULL, *sb = NULL;
+    if (sort_by != SORT_NAME) {
+        sa = entry_stat(ls, a);
+        sb = entry_stat(ls, b);
+    }
+    return sort_cmp(ENT_NAME(ls, a), sa, ENT_NAME(ls, b), sb);
+}
+
+void heap_sift_up(listing_t *ls, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (entry_cmp(ls, &ls->ents[parent], &ls->ents[i]) >= 0) break;
+        entry_t t = ls->ents[parent]; ls->ents[parent] = ls->ents[i]; ls->ents[i] = t;
+        i = parent;
+    }
+}
+
+void heap_sift_down(listing_t *ls, int i) {
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, top = i;
+        if (l < ls->n && entry_cmp(ls, &ls->ents[l], &ls->ents[top]) > 0) top = l;
+        if (r < ls->n && entry_cmp(ls, &ls->ents[r], &ls->ents[top]) > 0) top = r;
+        if (top == i) break;
+        entry_t t = ls->ents[top]; ls->ents[top] = ls->ents[i]; ls->ents[i] = t;
+        i = top;
+    }
+}
+
+/* rewrite the slab with only the names of live entries */
+int listing_compact(listing_t *ls) {
+    size_t live = 0;
+    for (int i = 0; i < ls->n; ++i) live += ls->ents[i].len + 1;
+    char *slab = malloc(live * 2 + 16384);
+    if (!slab) return -1;
+    size_t used = 0;
+    for (int i = 0; i < ls->n; ++i) {
+        entry_t *e = &ls->ents[i];
+        memcpy(slab + used, ENT_NAME(ls, e), e->len + 1);
+        e->off = (uint32_t)used;
+        used += e->len + 1;
+    }
+    free(ls->slab);
+    STAT_ADD(allocs, 1);
+    ls->slab = slab;
+    ls->used = used;
+    ls->cap = live * 2 + 16384;
+    ls->garbage = 0;
+    return 0;
+}
+
+/* The entry just appended at ls->n - 1 joins the heap, or is dropped (or
+ * displaces the root) once N entries are held */
+int heap_offer(listing_t *ls) {
+    int last = ls->n - 1;
+    if (sort_by != SORT_NAME) {
+        if (listing_st_reserve(ls, ls->ents[last].slot) == -1) return -1;
+        entry_stat(ls, &ls->ents[last]);
+    }
+    if ((size_t)ls->n <= head_limit) {
+        heap_sift_up(ls, last);
+        return 0;
+    }
+    entry_t *e = &ls->ents[last];
+    if (entry_cmp(ls, e, &ls->ents[0]) < 0) {
+        /* the new entry takes over the evicted root's metadata slot so
+         * slots stay within 0..N */
+        uint32_t slot = ls->ents[0].slot;
+        if (ls->st && (e->flags & ENT_SLOT_USED)) ls->st[slot] = ls->st[e->slot];
+        ls->garbage += ls->ents[0].len + 1;
+        e->slot = slot;
+        ls->ents[0] = *e;
+        ls->n--;
+        heap_sift_down(ls, 0);
+    } else {
+        ls->garbage += e->len + 1;
+        ls->n--;
+    }
+    if (ls->used > 65536 && ls->garbage > ls->used / 2) return listing_compact(ls);
+    return 0;
+}
+
+/* Read the open directory fd (skipping . and ..) into ls, which keeps the
+ * fd for later per-entry metadata. Returns -1 with errno set if it is
+ * unreadable (the fd is then closed); reporting is left to the caller. */
+int read_listing_fd(int fd, listing_t *ls) {
+    listing_init(ls);
+    dirstream_t ds;
+    if (ds_attach(&ds, fd) == -1) return -1;
+    ls->dirfd = ds.fd;   /* lets --head stat entries as they arrive */
+    struct linux_dirent64 *e;
+    unsigned long nread = 0;
+    int err = 0;
+    for (;;) {
+        errno = 0;
+        if ((e = ds_next(&ds)) == NULL) { err = errno; break; }
+        nread++;
+        if (listing_add(ls, e->d_name, strlen(e->d_name), e->d_type) == -1) goto fail;
+        if (head_limit && sort_by == SORT_NONE) {
+            if ((size_t)ls->n == head_limit) break;   /* unsorted: first N read */
+        } else if (head_limit && heap_offer(ls) == -1) {
+            goto fail;
+        }
+    }
+    if (err) { errno = err; perror("getdents64"); }
+    ds.fd = -1;
+    ds_close(&ds);
+    STAT_ADD(dirs, 1);
+    STAT_ADD(entries, nread);
+    return 0;
+
+fail:
+    err = errno;
+    ls->dirfd = -1;
+    listing_free(ls);
+    ds_close(&ds);
+    errno = err;
+    return -1;
+}
+
+/* read_listing_fd() of name relative to dirfd */
+int read_listing_at(int dirfd, const char *name, listing_t *ls) {
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    STAT_ADD(opens, 1);
+    if (fd == -1) return -1;
+    return read_listing_fd(fd, ls);
+}
+
+int read_listing(const char *dirpath, listing_t *ls) {
+    return read_listing_at(AT_FDCWD, dirpath, ls);
+}
+
+void print_stats(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    unsigned long sys = run_stats.opens + run_stats.getdents + run_stats.stats + run_stats.readlinks;
+    fprintf(stderr, "stats: %lu dirs, %lu entries, %lu allocations, peak RSS %ld KiB\n",
+            run_stats.dirs, run_stats.entries, run_stats.allocs, ru.ru_maxrss);
+    fprintf(stderr, "stats: syscalls %lu open, %lu getdents64, %lu stat, %lu readlink "
+            "(%.3f per entry)\n",
+            run_stats.opens, run_stats.getdents, run_stats.stats, run_stats.readlinks,
+            run_stats.entries ? (double)sys / run_stats.entries : 0.0);
+    fprintf(stderr, "stats: %lu user/group lookups, %lu served from cache\n",
+            run_stats.nss, run_stats.nss_hits);
+    if (run_stats.cache_hits)
+        fprintf(stderr, "stats: %lu directories served from --cache\n", run_stats.cache_hits);
+    if (run_stats.pruned)
+        fprintf(stderr, "stats: %lu unchanged directories not read by --diff\n", run_stats.pruned);
+}
+
+/* ---------------- color table ---------------- */
+
+/* Colors come from the built-in table below, overridden by LS_COLORS when
+ * it is set. LS_COLORS is parsed once at startup: type keys (di, ln, ex,
+ * ...) become complete escape sequences, and "*suffix" rules are inserted
+ * reversed and ASCII case-folded into a trie. Classifying a name then walks
+ * its tail backwards once, following one edge per character and keeping
+ * the longest rule that matched, however many rules there are. The built-in
+ * archive suffixes apply only when LS_COLORS is unset. */
+enum {
+    COL_DIR, COL_LINK, COL_FIFO, COL_SOCK, COL_BLK, COL_CHR,
+    COL_EXEC, COL_SETUID, COL_SETGID, COL_FILE, COL_NKINDS
+};
+
+static const char *const color_keys[COL_NKINDS] = {
+    "di", "ln", "pi", "so", "bd", "cd", "ex", "su", "sg", "fi"
+};
+
+static const char *color_kind[COL_NKINDS] = {
+    BLUE, MAGENTA, REVERSE, REVERSE, REVERSE, REVERSE, GREEN, "", "", ""
+};
+
+static const char *color_reset = RESET;
+static size_t color_reset_len = sizeof(RESET) - 1;
+
+/* LS_COLORS copy (lc/rc/ec point into it) and the escape sequences built
+ * from it, both kept for the whole run */
+static char *color_spec = NULL;
+static char *color_arena = NULL;
+static size_t color_arena_used = 0;
+
+static const char *const default_suffixes[] = { ".tar", ".tgz", ".tar.gz", ".gz", ".zip" };
+
+typedef struct {
+    unsigned char c;
+    int32_t       child, next;   /* first child / next sibling, -1 if none */
+    const char   *color;         /* set where a rule ends */
+} sfx_node_t;
+
+static sfx_node_t *sfx_nodes = NULL;
+static int32_t sfx_n = 0, sfx_cap = 0;
+static int32_t sfx_root[256];   /* last character of the name -> node */
+
+static unsigned char fold_ascii(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+int32_t sfx_child(int32_t parent, unsigned char c, int create) {
+    int32_t *link = parent == -1 ? &sfx_root[c] : &sfx_nodes[parent].child;
+    int32_t k = *link;
+    while (k != -1 && sfx_nodes[k].c != c) k = sfx_nodes[k].next;
+    if (k != -1 || !create) return k;
+    if (sfx_n == sfx_cap) {
+        int32_t cap = sfx_cap ? sfx_cap * 2 : 256;
+        sfx_node_t *tmp = realloc(sfx_nodes, sizeof(sfx_node_t) * cap);
+        if (!tmp) return -1;
+        sfx_nodes = tmp;
+        sfx_cap = cap;
+        link = parent == -1 ? &sfx_root[c] : &sfx_nodes[parent].child;
+    }
+    k = sfx_n++;
+    sfx_nodes[k] = (sfx_node_t){ c, -1, *link, NULL };
+    *link = k;
+    return k;
+}
+
+/* later rules for the same suffix replace earlier ones, as in GNU ls */
+void sfx_insert(const char *suffix, size_t len, const char *color) {
+    int32_t node = -1;
+    for (size_t i = len; i-- > 0; ) {
+        node = sfx_child(node, fold_ascii((unsigned char)suffix[i]), 1);
+        if (node == -1) return;
+    }
+    if (node != -1) sfx_nodes[node].color = color;
+}
+
+/* color of the longest suffix rule matching name, or NULL */
+const char *sfx_match(const char *name, size_t len) {
+    const char *best = NULL;
+    int32_t node = -1;
+    for (size_t i = len; i-- > 0; ) {
+        node = sfx_child(node, fold_ascii((unsigned char)name[i]), 0);
+        if (node == -1) break;
+        if (sfx_nodes[node].color) best = sfx_nodes[node].color;
+    }
+    return best;
+}
+
+/* decode the backslash and caret escapes dircolors emits, in place */
+size_t color_unescape(char *s) {
+    char *w = s;
+    for (char *r = s; *r; ++r) {
+        if (*r == '\\' && r[1]) {
+            switch (*++r) {
+                case 'e': case 'E': *w++ = '\033'; break;
+                case 'a': *w++ = '\a'; break;
+                case 'b': *w++ = '\b'; break;
+                case 'n': *w++ = '\n'; break;
+                case 'r': *w++ = '\r'; break;
+                case 't': *w++ = '\t'; break;
+                case '_': *w++ = ' '; break;
+                default:  *w++ = *r; break;
+            }
+        } else if (*r == '^' && r[1]) {
+            ++r;
+            *w++ = *r == '?' ? 0x7f : (*r & 0x1f);
+        } else {
+            *w++ = *r;
+        }
+    }
+    *w = '\0';
+    return (size_t)(w - s);
+}
+
+/* lc + code + rc as one string in the arena, or "" for an empty code */
+const char *color_seq(const char *lc, const char *code, const char *rc) {
+    if (!*code || !color_arena) return "";
+    char *seq = color_arena + color_arena_used;
+    color_arena_used += (size_t)sprintf(seq, "%s%s%s", lc, code, rc) + 1;
+    return seq;
+}
+
+/* Build the color table; the strings live for the whole run */
+void colors_init(void) {
+    for (int i = 0; i < 256; ++i) sfx_root[i] = -1;
+    const char *env = getenv("LS_COLORS");
+    if (!env || !*env) {
+        for (size_t i = 0; i < sizeof(default_suffixes) / sizeof(default_suffixes[0]); ++i)
+            sfx_insert(default_suffixes[i], strlen(default_suffixes[i]), RED);
+        return;
+    }
+    char *spec = color_spec = strdup(env);
+    if (!spec) return;
+
+    /* lc/rc/ec may come after the rules that need them: find them first */
+    const char *lc = "\033[", *rc = "m", *ec = NULL;
+    size_t nrules = 1;
+    for (char *p = spec; *p; ++p) nrules += (*p == ':');
+    char **keys = malloc(sizeof(char *) * nrules), **vals = malloc(sizeof(char *) * nrules);
+    if (!keys || !vals) { free(keys); free(vals); free(spec); return; }
+    size_t n = 0;
+    for (char *tok = strtok(spec, ":"); tok; tok = strtok(NULL, ":")) {
+        char *eq = strchr(tok, '=');
+        if (!eq || eq == tok) continue;
+        *eq = '\0';
+        color_unescape(eq + 1);
+        if (strcmp(tok, "lc") == 0) lc = eq + 1;
+        else if (strcmp(tok, "rc") == 0) rc = eq + 1;
+        else if (strcmp(tok, "ec") == 0) ec = eq + 1;
+        else { keys[n] = tok; vals[n] = eq + 1; n++; }
+    }
+
+    size_t arena = 0, wrap = strlen(lc) + strlen(rc) + 1;
+    for (size_t i = 0; i < n; ++i) arena += strlen(vals[i]) + wrap;
+    color_arena = malloc(arena + wrap + 1);   /* + the default "0" reset */
+    const char *rs = ec ? ec : color_seq(lc, "0", rc);
+    for (size_t i = 0; i < n; ++i) {
+        if (keys[i][0] == '*') {
+            size_t len = color_unescape(keys[i] + 1);
+            sfx_insert(keys[i] + 1, len, color_seq(lc, vals[i], rc));
+            continue;
+        }
+        if (strcmp(keys[i], "rs") == 0 && !ec) rs = color_seq(lc, vals[i], rc);
+        for (int k = 0; k < COL_NKINDS; ++k)
+            if (strcmp(keys[i], color_keys[k]) == 0) color_kind[k] = color_seq(lc, vals[i], rc);
+    }
+    if (*rs) {
+        color_reset = rs;
+        color_reset_len = strlen(rs);
+    }
+    free(keys);
+    free(vals);
+}
+
+/* ---------------- color decision ---------------- */
+
+/* Whether regular files are stat'ed for their mode bits when choosing a
+ * color. Cleared by --no-exec-color, or when ex, su and sg have no color,
+ * so a colored listing costs no metadata calls at all on file systems that
+ * report d_type; entries already stat'ed (e.g. for -l) still use theirs. */
+static int color_stat_files = 1;
+
+void color_configure(int no_exec_color) {
+    color_stat_files = !no_exec_color &&
+        (*color_kind[COL_EXEC] || *color_kind[COL_SETUID] || *color_kind[COL_SETGID]);
+}
+
+/* Color for an entry. The d_type from getdents64 settles everything but
+ * regular files, which are only stat'ed for their set-id and executable
+ * bits; suffix rules apply to regular files only. */
+const char* choose_color_for(listing_t *ls, entry_t *e) {
+    if (e->type == DT_UNKNOWN && !entry_stat(ls, e))
+        return ""; /* fallback: no color */
+
+    switch (e->type) {
+        case DT_LNK:  return color_kind[COL_LINK];
+        case DT_CHR:  return color_kind[COL_CHR];
+        case DT_BLK:  return color_kind[COL_BLK];
+        case DT_SOCK: return color_kind[COL_SOCK];
+        case DT_FIFO: return color_kind[COL_FIFO];
+        case DT_DIR:  return color_kind[COL_DIR];
+        default: break;
+    }
+    const struct stat *st = NULL;
+    if (color_stat_files) st = entry_stat(ls, e);
+    else if (e->flags & ENT_HAVE_STAT) st = ENT_STAT(ls, e);
+    if (st) {
+        if ((st->st_mode & S_ISUID) && *color_kind[COL_SETUID]) return color_kind[COL_SETUID];
+        if ((st->st_mode & S_ISGID) && *color_kind[COL_SETGID]) return color_kind[COL_SETGID];
+        if ((st->st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) && *color_kind[COL_EXEC])
+            return color_kind[COL_EXEC];
+    }
+    const char *sfx = sfx_match(ENT_NAME(ls, e), e->len);
+    return sfx ? sfx : color_kind[COL_FILE];
+}
+
+void print_colored_padded(listing_t *ls, entry_t *e, int pad, int last) {
+    const char *name = ENT_NAME(ls, e);
+    const char *start = "";
+    if (color_enabled) start = choose_color_for(ls, e);
+
+    if (color_enabled && start && start[0] != '\0') {
+        out_str(start);
+        out_write(name, e->len);
+        out_write(color_reset, color_reset_len);
+    } else {
+        out_write(name, e->len);
+    }
+
+    if (!last && pad > 0) {
+        int visible = e->width;
+        int to_pad = pad - visible;
+        if (to_pad > 0) out_spaces(to_pad);
+    }
+}
+
+/* ---------------- display implementations ---------------- */
+
+void print_one_per_line(listing_t *ls) {
+    for (int i = 0; i < ls->n; ++i) {
+        print_colored_padded(ls, &ls->ents[i], 0, 1);
+        out_char('\n');
+    }
+}
+
+/* GNU-style variable-width columns: every column is as wide as its longest
+ * name plus two spaces of separation (the last column needs none), and the
+ * layout with the most columns that fits the terminal wins. All candidate
+ * column counts are evaluated in a single pass over the names, keeping a
+ * running line length per candidate and dropping a candidate as soon as it
+ * overflows, so the cost is O(n * max_cols) with max_cols <= width / 3. */
+#define MIN_COLUMN_WIDTH 3   /* one character plus two spaces */
+
+typedef struct {
+    int  ncols, nrows;
+    int *widths;   /* per column, separation included */
+} layout_t;
+
+/* Pick the layout for ls, filling down columns (by_columns) or across rows */
+int layout_compute(listing_t *ls, int by_columns, layout_t *lay) {
+    int n = ls->n;
+    int termw = get_term_width();
+    int max_cols = termw / MIN_COLUMN_WIDTH + (termw % MIN_COLUMN_WIDTH != 0);
+    if (max_cols > n) max_cols = n;
+    if (max_cols < 1) max_cols = 1;
+
+    /* candidate c (c + 1 columns) owns widths[c * (c + 1) / 2 ..][0..c] */
+    size_t total = (size_t)max_cols * (max_cols + 1) / 2;
+    int *widths = malloc(sizeof(int) * total);
+    int *line_len = malloc(sizeof(int) * max_cols);
+    char *valid = malloc(max_cols);
+    if (!widths || !line_len || !valid) {
+        free(widths); free(line_len); free(valid);
+        return -1;
+    }
+    for (size_t i = 0; i < total; ++i) widths[i] = MIN_COLUMN_WIDTH;
+    for (int c = 0; c < max_cols; ++c) {
+        line_len[c] = (c + 1) * MIN_COLUMN_WIDTH;
+        valid[c] = 1;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        int len = ls->ents[i].width;
+        for (int c = 0; c < max_cols; ++c) {
+            if (!valid[c]) continue;
+            int cols = c + 1;
+            int idx = by_columns ? i / ((n + cols - 1) / cols) : i % cols;
+            int real = len + (idx == cols - 1 ? 0 : 2);
+            int *w = &widths[(size_t)c * cols / 2 + idx];
+            if (*w < real) {
+                line_len[c] += real - *w;
+                *w = real;
+                valid[c] = line_len[c] < termw;
+            }
+        }
+    }
+
+    int c = max_cols - 1;
+    while (c > 0 && !valid[c]) c--;
+    lay->ncols = c + 1;
+    lay->nrows = (n + lay->ncols - 1) / lay->ncols;
+    memmove(widths, widths + (size_t)c * (c + 1) / 2, sizeof(int) * lay->ncols);
+    lay->widths = widths;
+    free(line_len);
+    free(valid);
+    return 0;
+}
+
+void print_columns_down_across(listing_t *ls) {
+    int n = ls->n;
+    if (n <= 0) return;
+    layout_t lay;
+    if (layout_compute(ls, 1, &lay) == -1) { print_one_per_line(ls); return; }
+
+    for (int r = 0; r < lay.nrows; ++r) {
+        for (int c = 0; c < lay.ncols; ++c) {
+            int idx = r + c * lay.nrows;
+            if (idx >= n) break;
+            int last = (c == lay.ncols - 1 || idx + lay.nrows >= n);
+            print_colored_padded(ls, &ls->ents[idx], lay.widths[c], last);
+        }
+        out_char('\n');
+    }
+    free(lay.widths);
+}
+
+void print_horizontal(listing_t *ls) {
+    int n = ls->n;
+    if (n <= 0) return;
+    layout_t lay;
+    if (layout_compute(ls, 0, &lay) == -1) { print_one_per_line(ls); return; }
+
+    for (int i = 0; i < n; ++i) {
+        int c = i % lay.ncols;
+        int last = (c == lay.ncols - 1 || i == n - 1);
+        print_colored_padded(ls, &ls->ents[i], lay.widths[c], last);
+        if (last) out_char('\n');
+    }
+    free(lay.widths);
+}
+
+/* ---------------- user/group name cache ---------------- */
+
+/* Owner and group names are resolved through NSS once per id and kept for
+ * the whole run (all directories of -R), in small open-addressing tables. */
+typedef struct {
+    uint32_t id;
+    int      used;
+    char    *name;
+} idname_t;
+
+typedef struct {
+    idname_t *slots;
+    size_t    cap, n;   /* cap is a power of two */
+} idcache_t;
+
+static idcache_t user_cache, group_cache;
+static int numeric_ids = 0;   /* -n: print ids, never ask NSS */
+
+static size_t id_hash(uint32_t id, size_t cap) {
+    return (size_t)((id * 2654435761u) & (cap - 1));
+}
+
+int idcache_grow(idcache_t *c) {
+    size_t cap = c->cap ? c->cap * 2 : 64;
+    idname_t *slots = calloc(cap, sizeof(idname_t));
+    if (!slots) return -1;
+    for (size_t i = 0; i < c->cap; ++i) {
+        if (!c->slots[i].used) continue;
+        size_t j = id_hash(c->slots[i].id, cap);
+        while (slots[j].used) j = (j + 1) & (cap - 1);
+        slots[j] = c->slots[i];
+    }
+    free(c->slots);
+    c->slots = slots;
+    c->cap = cap;
+    return 0;
+}
+
+/* Name to print for a uid (is_group == 0) or gid; "?" if unknown */
+const char *idcache_name(idcache_t *c, uint32_t id, int is_group) {
+    if (c->cap) {
+        size_t j = id_hash(id, c->cap);
+        while (c->slots[j].used) {
+            if (c->slots[j].id == id) {
+                STAT_ADD(nss_hits, 1);
+                return c->slots[j].name;
+            }
+            j = (j + 1) & (c->cap - 1);
+        }
+    }
+
+    char num[16];
+    const char *name = "?";
+    if (numeric_ids) {
+        snprintf(num, sizeof(num), "%u", id);
+        name = num;
+    } else {
+        STAT_ADD(nss, 1);
+        if (is_group) {
+            struct group *gr = getgrgid((gid_t)id);
+            if (gr) name = gr->gr_name;
+        } else {
+            struct passwd *pw = getpwuid((uid_t)id);
+            if (pw) name = pw->pw_name;
+        }
+    }
+
+    char *copy = strdup(name);
+    if (!copy || ((c->n + 1) * 2 > c->cap && idcache_grow(c) == -1)) {
+        free(copy);
+        return "?";
+    }
+    size_t j = id_hash(id, c->cap);
+    while (c->slots[j].used) j = (j + 1) & (c->cap - 1);
+    c->slots[j].id = id;
+    c->slots[j].used = 1;
+    c->slots[j].name = copy;
+    c->n++;
+    return copy;
+}
+
+/* ---------------- timestamp formatting ---------------- */
+
+/* The long listing shows "Mon dd HH:MM" for recent files and
+ * "Mon dd  YYYY" otherwise. The current time and zone are captured once,
+ * and the local date of the last day seen is cached so entries from the
+ * same day only need the hour and minute digits recomputed, without
+ * another localtime call. */
+#define SIX_MONTHS 15552000L
+
+static time_t now_cached;
+
+static struct {
+    int    valid;
+    time_t day_start;   /* UTC instant of that local midnight */
+    char   date[7];     /* "Mon dd" */
+    char   year[5];
+    int    year_ok;     /* year fits in four digits */
+} tcache;
+
+static const char month_abbr[12][4] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+void time_init(void) {
+    tzset();
+    now_cached = time(NULL);
+}
+
+/* Fill the cache for the local day containing t. Days with a UTC offset
+ * change (DST switches) are not cached; returns 0 for those. */
+int tcache_fill(time_t t, struct tm *tm) {
+    tcache.valid = 0;
+    time_t start = t - (tm->tm_hour * 3600 + tm->tm_min * 60 + tm->tm_sec);
+    time_t last = start + 86399;
+    struct tm a, b;
+    if (!localtime_r(&start, &a) || !localtime_r(&last, &b)) return 0;
+    if (a.tm_gmtoff != tm->tm_gmtoff || b.tm_gmtoff != tm->tm_gmtoff) return 0;
+
+    memcpy(tcache.date, month_abbr[tm->tm_mon], 3);
+    tcache.date[3] = ' ';
+    tcache.date[4] = tm->tm_mday >= 10 ? (char)('0' + tm->tm_mday / 10) : ' ';
+    tcache.date[5] = (char)('0' + tm->tm_mday % 10);
+    tcache.date[6] = '\0';
+    int y = tm->tm_year + 1900;
+    tcache.year_ok = (y >= 1000 && y <= 9999);
+    for (int i = 3; i >= 0; --i) { tcache.year[i] = (char)('0' + y % 10); y /= 10; }
+    tcache.day_start = start;
+    tcache.valid = 1;
+    return 1;
+}
+
+/* Write the long-listing timestamp for t into buf (>= 16 bytes) */
+int format_mtime(time_t t, char *buf, size_t size) {
+    int recent = llabs((long long)(now_cached - t)) <= SIX_MONTHS;
+    if (!(tcache.valid && t >= tcache.day_start && t - tcache.day_start < 86400)) {
+        struct tm tm;
+        if (!localtime_r(&t, &tm)) return snprintf(buf, size, "?");
+        if (!tcache_fill(t, &tm) || (!recent && !tcache.year_ok))
+            return (int)strftime(buf, size, recent ? "%b %e %H:%M" : "%b %e  %Y", &tm);
+    }
+    if (!recent && !tcache.year_ok) {
+        struct tm tm;
+        localtime_r(&t, &tm);
+        return (int)strftime(buf, size, "%b %e  %Y", &tm);
+    }
+
+    memcpy(buf, tcache.date, 6);
+    buf[6] = ' ';
+    if (recent) {
+        int secs = (int)(t - tcache.day_start);
+        int hh = secs / 3600, mm = secs / 60 % 60;
+        buf[7]  = (char)('0' + hh / 10);
+        buf[8]  = (char)('0' + hh % 10);
+        buf[9]  = ':';
+        buf[10] = (char)('0' + mm / 10);
+        buf[11] = (char)('0' + mm % 10);
+    } else {
+        buf[7] = ' ';
+        memcpy(buf + 8, tcache.year, 4);
+    }
+    buf[12] = '\0';
+    return 12;
+}
+
+/* Long listing helpers */
+void print_permissions(mode_t mode) {
+    char perms[11];
+    perms[0] = S_ISDIR(mode) ? 'd' :
+               S_ISLNK(mode) ? 'l' :
+               S_ISCHR(mode) ? 'c' :
+               S_ISBLK(mode) ? 'b' :
+               S_ISSOCK(mode)? 's' :
+               S_ISFIFO(mode)? 'p' : '-';
+    perms[1] = (mode & S_IRUSR) ? 'r' : '-';
+    perms[2] = (mode & S_IWUSR) ? 'w' : '-';
+    perms[3] = (mode & S_IXUSR) ? ((mode & S_ISUID) ? 's' : 'x') : ((mode & S_ISUID) ? 'S' : '-');
+    perms[4] = (mode & S_IRGRP) ? 'r' : '-';
+    perms[5] = (mode & S_IWGRP) ? 'w' : '-';
+    perms[6] = (mode & S_IXGRP) ? ((mode & S_ISGID) ? 's' : 'x') : ((mode & S_ISGID) ? 'S' : '-');
+    perms[7] = (mode & S_IROTH) ? 'r' : '-';
+    perms[8] = (mode & S_IWOTH) ? 'w' : '-';
+    perms[9] = (mode & S_IXOTH) ? ((mode & S_ISVTX) ? 't' : 'x') : ((mode & S_ISVTX) ? 'T' : '-');
+    out_write(perms, 10);
+}
+
+/* Render an already read and sorted listing in long format */
+void print_long_listing(listing_t *ls) {
+    for (int i = 0; i < ls->n; ++i) {
+        entry_t *e = &ls->ents[i];
+        const char *name = ENT_NAME(ls, e);
+        const struct stat *st = entry_stat(ls, e);
+        if (!st) { out_perror(name); continue; }
+        print_permissions(st->st_mode);
+        const char *owner = idcache_name(&user_cache, st->st_uid, 0);
+        const char *group = idcache_name(&group_cache, st->st_gid, 1);
+
+        char timebuf[64];
+        int tlen = format_mtime(st->st_mtime, timebuf, sizeof(timebuf));
+
+        out_char(' ');
+        out_int((long long)st->st_nlink, 2);
+        out_char(' ');
+        out_str_left(owner, 8);
+        out_char(' ');
+        out_str_left(group, 8);
+        out_char(' ');
+        out_int((long long)st->st_size, 8);
+        out_char(' ');
+        out_write(timebuf, (size_t)tlen);
+        out_char(' ');
+
+        const char *start = "";
+        if (color_enabled) start = choose_color_for(ls, e);
+
+        if (color_enabled && start[0] != '\0') {
+            out_str(start);
+            out_write(name, e->len);
+            out_write(color_reset, color_reset_len);
+        } else {
+            out_write(name, e->len);
+        }
+
+        if (S_ISLNK(st->st_mode) && ls->links) {
+            if (ls->links[e->slot]) {
+                out_write(" -> ", 4);
+                out_str(ls->links[e->slot]);
+            }
+        } else if (S_ISLNK(st->st_mode)) {
+            char link_target[PATH_MAX];
+            STAT_ADD(readlinks, 1);
+            ssize_t len = readlinkat(ls->dirfd, name, link_target, sizeof(link_target)-1);
+            if (len != -1) {
+                out_write(" -> ", 4);
+                out_write(link_target, (size_t)len);
+            }
+        }
+        out_char('\n');
+    }
+}
+
+/* ---------------- recursive do_ls ---------------- */
+
+typedef enum { MODE_DEFAULT=0, MODE_LONG=1, MODE_HORIZONTAL=2, MODE_ONE=3 } display_mode_t;
+
+void display_listing(listing_t *ls, display_mode_t mode) {
+    if (mode == MODE_LONG) {
+        print_long_listing(ls);
+    } else if (mode == MODE_HORIZONTAL) {
+        print_horizontal(ls);
+    } else if (mode == MODE_ONE) {
+        print_one_per_line(ls);
+    } else {
+        print_columns_down_across(ls);
+    }
+}
+
+/* Fetch up front, as one batch, everything sorting, display_listing() and
+ * the -R walk will ask for, so scanning threads absorb the metadata
+ * latency, not the printer. */
+void listing_prefetch(listing_t *ls, display_mode_t mode) {
+    uint32_t *idx = malloc(sizeof(uint32_t) * (ls->n ? ls->n : 1));
+    size_t n = 0;
+    int all = mode == MODE_LONG || sort_by == SORT_SIZE || sort_by == SORT_TIME || du_enabled ||
+              meta_all;
+    for (int i = 0; i < ls->n; ++i) {
+        entry_t *e = &ls->ents[i];
+        if (e->flags & (ENT_HAVE_STAT | ENT_STAT_FAILED)) continue;
+        if (all || e->type == DT_UNKNOWN ||
+            (color_enabled && color_stat_files && e->type == DT_REG)) {
+            if (idx) idx[n++] = (uint32_t)i;
+            else entry_stat(ls, e);
+        }
+    }
+    listing_fetch_batch(ls, idx, n);
+    free(idx);
+}
+
+/* ---------------- streaming unsorted listing ---------------- */
+
+/* -U/-f without -R: entries are rendered one getdents64 batch at a time and
+ * the batch is then reused, so output starts as soon as the first batch
+ * arrives and memory does not grow with the directory. Column layouts need
+ * every name up front, so they become one name per line here. */
+void stream_render(listing_t *batch, display_mode_t mode) {
+    if (batch->n == 0) return;
+    listing_prefetch(batch, mode);
+    display_listing(batch, mode == MODE_LONG ? MODE_LONG : MODE_ONE);
+    out_flush();
+    batch->n = 0;
+    batch->used = 0;
+}
+
+int stream_listing(const char *dirpath, display_mode_t mode) {
+    dirstream_t ds;
+    if (ds_openat(&ds, AT_FDCWD, dirpath) == -1) return -1;
+    listing_t batch;
+    listing_init(&batch);
+    batch.dirfd = ds.fd;   /* borrowed for lazy stat and readlink */
+
+    struct linux_dirent64 *e;
+    unsigned long nread = 0;
+    int rc = 0, err = 0;
+    for (;;) {
+        errno = 0;
+        if ((e = ds_next(&ds)) == NULL) { err = errno; break; }
+        if (listing_add(&batch, e->d_name, strlen(e->d_name), e->d_type) == -1) {
+            rc = -1;
+            err = errno;
+            break;
+        }
+        nread++;
+        if (head_limit && nread == head_limit) break;
+        if (ds.pos >= ds.len) stream_render(&batch, mode);
+    }
+    stream_render(&batch, mode);
+    if (rc == 0 && err) { errno = err; out_perror("getdents64"); }
+
+    batch.dirfd = -1;
+    listing_free(&batch);
+    ds_close(&ds);
+    STAT_ADD(dirs, 1);
+    STAT_ADD(entries, nread);
+    errno = err;
+    return rc;
+}
+
+/* ---------------- external merge sort ---------------- */
+
+/* --mem-budget=SIZE bounds what a sorted listing keeps in memory. When the
+ * names, entry records and sort scratch of the entries read so far would
+ * exceed it, they are sorted and appended as one run to an unlinked temp
+ * file (in $TMPDIR, else /tmp) and the listing is reused for the next run.
+ * The runs are then k-way merged through a heap of run heads and printed in
+ * batches like the streaming mode, so only one read buffer per run stays
+ * resident; when more runs than the budget has buffers for pile up, they are
+ * first merged in groups into a new file, pass after pass. A directory that fits in the budget is listed as usual. */
+static size_t mem_budget = 0;   /* 0: unlimited */
+
+#define RUN_BATCH   4096              /* merged entries printed per batch */
+#define SPILL_BUF   (256 * 1024)
+#define RUNBUF_MIN  (16 * 1024)       /* must hold the largest record */
+#define RUNBUF_MAX  (1024 * 1024)
+
+typedef struct {
+    uint16_t len;
+    uint8_t  type;
+    uint8_t  flags;   /* ENT_*; a struct stat follows if ENT_SLOT_USED */
+} runrec_t;           /* ... then len name bytes */
+
+typedef struct {
+    int     fd;
+    off_t   size;     /* bytes written to the file so far */
+    char   *buf;
+    size_t  len;
+    off_t  *runs;     /* run i is [runs[i], runs[i + 1]) */
+    size_t  nruns, rcap;
+} spill_t;
+
+typedef struct {
+    off_t        off, end;   /* unread part of the run in the file */
+    char        *buf;
+    size_t       pos, len, cap;
+    runrec_t     hdr;
+    struct stat  st;
+    char         name[NAME_MAX + 1];
+} runreader_t;
+
+int write_all(int fd, const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+int spill_open(spill_t *sp) {
+    const char *dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+    if (!dir || !*dir) dir = "/tmp";
+    if (snprintf(path, sizeof(path), "%s/ls-runs.XXXXXX", dir) >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(sp, 0, sizeof(*sp));
+    sp->fd = mkostemp(path, O_CLOEXEC);
+    if (sp->fd == -1) return -1;
+    unlink(path);
+    sp->buf = malloc(SPILL_BUF);
+    sp->runs = malloc(sizeof(off_t) * 16);
+    if (!sp->buf || !sp->runs) { errno = ENOMEM; return -1; }
+    sp->runs[0] = 0;
+    sp->rcap = 16;
+    return 0;
+}
+
+/* Create a new file beside path to be renamed over it once complete, its
+ * name in tmp (len bytes); mode 0644 less the umask as open() would give */
+int create_beside(const char *path, char *tmp, size_t len) {
+    snprintf(tmp, len, "%s.tmp.XXXXXX", path);
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd == -1) return -1;
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0644 & ~mask);
+    return fd;
+}
+
+int spill_put(spill_t *sp, const void *p, size_t n) {
+    if (sp->len + n > SPILL_BUF) {
+        if (write_all(sp->fd, sp->buf, sp->len) == -1) return -1;
+        sp->len = 0;
+        if (n > SPILL_BUF) {
+            if (write_all(sp->fd, p, n) == -1) return -1;
+            sp->size += (off_t)n;
+            return 0;
+        }
+    }
+    memcpy(sp->buf + sp->len, p, n);
+    sp->len += n;
+    sp->size += (off_t)n;
+    return 0;
+}
+
+/* close the run being written: flush it and record where it ends */
+int spill_end_run(spill_t *sp) {
+    if (write_all(sp->fd, sp->buf, sp->len) == -1) return -1;
+    sp->len = 0;
+    if (sp->nruns + 2 > sp->rcap) {
+        off_t *tmp = realloc(sp->runs, sizeof(off_t) * sp->rcap * 2);
+        if (!tmp) return -1;
+        sp->runs = tmp;
+        sp->rcap *= 2;
+    }
+    sp->runs[++sp->nruns] = sp->size;
+    return 0;
+}
+
+/* sort ls and append it to the spill file as one run, then empty ls */
+int spill_run(spill_t *sp, listing_t *ls) {
+    listing_sort(ls);
+    for (int i = 0; i < ls->n; ++i) {
+        entry_t *e = &ls->ents[i];
+        runrec_t h = { (uint16_t)e->len, e->type, e->flags & (ENT_HAVE_STAT | ENT_STAT_FAILED) };
+        if (spill_put(sp, &h, sizeof(h)) == -1) return -1;
+        if ((h.flags & ENT_SLOT_USED) &&
+            spill_put(sp, ENT_STAT(ls, e), sizeof(struct stat)) == -1) return -1;
+        if (spill_put(sp, ENT_NAME(ls, e), e->len) == -1) return -1;
+    }
+    if (spill_end_run(sp) == -1) return -1;
+    ls->n = 0;
+    ls->used = 0;
+    ls->garbage = 0;
+    return 0;
+}
+
+void spill_close(spill_t *sp) {
+    if (sp->fd != -1) close(sp->fd);
+    free(sp->buf);
+    free(sp->runs);
+}
+
+/* have at least n unread bytes in r->buf; -1 on error or a truncated run */
+int runreader_fill(int fd, runreader_t *r, size_t n) {
+    if (r->len - r->pos >= n) return 0;
+    memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+    r->len -= r->pos;
+    r->pos = 0;
+    while (r->len < n && r->off < r->end) {
+        size_t want = r->cap - r->len;
+        if ((off_t)want > r->end - r->off) want = (size_t)(r->end - r->off);
+        ssize_t got = pread(fd, r->buf + r->len, want, r->off);
+        if (got == -1 && errno == EINTR) continue;
+        if (got <= 0) {
+            if (got == 0) errno = EIO;
+            return -1;
+        }
+        r->len += (size_t)got;
+        r->off += got;
+    }
+    if (r->len < n) { errno = EIO; return -1; }
+    return 0;
+}
+
+/* load the next record of r; 1 if one was read, 0 at end of run */
+int runreader_next(int fd, runreader_t *r) {
+    if (r->pos == r->len && r->off >= r->end) return 0;
+    if (runreader_fill(fd, r, sizeof(runrec_t)) == -1) return -1;
+    memcpy(&r->hdr, r->buf + r->pos, sizeof(runrec_t));
+    size_t body = r->hdr.len + ((r->hdr.flags & ENT_SLOT_USED) ? sizeof(struct stat) : 0);
+    if (r->hdr.len > NAME_MAX ||
+        runreader_fill(fd, r, sizeof(runrec_t) + body) == -1) {
+        errno = EIO;
+        return -1;
+    }
+    r->pos += sizeof(runrec_t);
+    if (r->hdr.flags & ENT_SLOT_USED) {
+        memcpy(&r->st, r->buf + r->pos, sizeof(struct stat));
+        r->pos += sizeof(struct stat);
+    }
+    memcpy(r->name, r->buf + r->pos, r->hdr.len);
+    r->name[r->hdr.len] = '\0';
+    r->pos += r->hdr.len;
+    return 1;
+}
+
+int runreader_cmp(const runreader_t *a, const runreader_t *b) {
+    return sort_cmp(a->name, (a->hdr.flags & ENT_HAVE_STAT) ? &a->st : NULL,
+                    b->name, (b->hdr.flags & ENT_HAVE_STAT) ? &b->st : NULL);
+}
+
+void merge_sift_down(runreader_t **heap, size_t n, size_t i) {
+    for (;;) {
+        size_t l = 2 * i + 1, r = l + 1, top = i;
+        if (l < n && runreader_cmp(heap[l], heap[top]) < 0) top = l;
+        if (r < n && runreader_cmp(heap[r], heap[top]) < 0) top = r;
+        if (top == i) break;
+        runreader_t *t = heap[top]; heap[top] = heap[i]; heap[i] = t;
+        i = top;
+    }
+}
+
+/* Merge runs [lo, hi) of sp in sort order: appended to out as one run, or
+ * when out is NULL into batch (which borrows the directory fd for lazy
+ * metadata), printed every RUN_BATCH entries */
+int merge_group(spill_t *sp, size_t lo, size_t hi, spill_t *out, listing_t *batch,
+                display_mode_t mode) {
+    size_t k = hi - lo, bufsz = mem_budget / (2 * k);
+    if (bufsz < RUNBUF_MIN) bufsz = RUNBUF_MIN;
+    if (bufsz > RUNBUF_MAX) bufsz = RUNBUF_MAX;
+    runreader_t *rd = calloc(k, sizeof(runreader_t));
+    runreader_t **heap = malloc(sizeof(runreader_t *) * k);
+    char *bufs = malloc(bufsz * k);
+    int rc = -1;
+    if (!rd || !heap || !bufs) goto out;
+
+    size_t n = 0;
+    for (size_t i = 0; i < k; ++i) {
+        rd[i].off = sp->runs[lo + i];
+        rd[i].end = sp->runs[lo + i + 1];
+        rd[i].buf = bufs + i * bufsz;
+        rd[i].cap = bufsz;
+        int got = runreader_next(sp->fd, &rd[i]);
+        if (got == -1) goto out;
+        if (got) heap[n++] = &rd[i];
+    }
+    for (size_t i = n / 2; i-- > 0; ) merge_sift_down(heap, n, i);
+
+    while (n > 0) {
+        runreader_t *r = heap[0];
+        if (out) {
+            if (spill_put(out, &r->hdr, sizeof(r->hdr)) == -1) goto out;
+            if ((r->hdr.flags & ENT_SLOT_USED) &&
+                spill_put(out, &r->st, sizeof(struct stat)) == -1) goto out;
+            if (spill_put(out, r->name, r->hdr.len) == -1) goto out;
+        } else {
+            if (listing_add(batch, r->name, r->hdr.len, r->hdr.type) == -1) goto out;
+            entry_t *e = &batch->ents[batch->n - 1];
+            e->flags = r->hdr.flags;
+            if (e->flags & ENT_SLOT_USED) {
+                if (listing_st_reserve(batch, e->slot) == -1) goto out;
+                *ENT_STAT(batch, e) = r->st;
+            }
+            if (batch->n == RUN_BATCH) stream_render(batch, mode);
+        }
+
+        int got = runreader_next(sp->fd, r);
+        if (got == -1) goto out;
+        if (!got) heap[0] = heap[--n];
+        merge_sift_down(heap, n, 0);
+    }
+    if (out) {
+        if (spill_end_run(out) == -1) goto out;
+    } else {
+        stream_render(batch, mode);
+    }
+    rc = 0;
+out:
+    free(bufs);
+    free(heap);
+    free(rd);
+    return rc;
+}
+
+/* Merge the runs of sp into batch and print them. Each open run needs a
+ * read buffer of at least RUNBUF_MIN, so at most as many runs as the
+ * budget has room for are merged at once; with more, groups of them are
+ * first merged into longer runs in a new file, pass after pass. */
+int merge_runs(spill_t *sp, listing_t *batch, display_mode_t mode) {
+    size_t fanin = mem_budget / (RUNBUF_MIN + sizeof(runreader_t) + sizeof(runreader_t *));
+    if (fanin < 2) fanin = 2;
+    free(sp->buf);   /* sp is only read from now on */
+    sp->buf = NULL;
+    while (sp->nruns > fanin) {
+        spill_t next;
+        if (spill_open(&next) == -1) { spill_close(&next); return -1; }
+        for (size_t lo = 0; lo < sp->nruns; lo += fanin) {
+            size_t hi = lo + fanin < sp->nruns ? lo + fanin : sp->nruns;
+            if (merge_group(sp, lo, hi, &next, NULL, mode) == -1) {
+                spill_close(&next);
+                return -1;
+            }
+        }
+        spill_close(sp);
+        *sp = next;
+        free(sp->buf);
+        sp->buf = NULL;
+    }
+    return merge_group(sp, 0, sp->nruns, NULL, batch, mode);
+}
+
+/* Sorted listing of dirpath within mem_budget; reports its own errors */
+int budget_listing(const char *dirpath, display_mode_t mode) {
+    dirstream_t ds;
+    if (ds_openat(&ds, AT_FDCWD, dirpath) == -1) { out_perror("opendir"); return -1; }
+    listing_t ls;
+    listing_init(&ls);
+    ls.dirfd = ds.fd;   /* borrowed: -S/-t stat each run before it spills */
+
+    /* rough resident cost: entry record, sort pairs and strings, cached
+     * metadata when the order needs it, and strxfrm images for --collate */
+    size_t per_entry = sizeof(entry_t) + 2 * sizeof(sortpair_t) + sizeof(sortstr_t) +
+                       (sort_by != SORT_NAME ? sizeof(struct stat) : 0);
+    size_t per_byte = collate_enabled ? 5 : 1;
+
+    spill_t sp = { .fd = -1 };
+    const char *what = "getdents64";
+    struct linux_dirent64 *e;
+    unsigned long nread = 0;
+    int rc = 0;
+    for (;;) {
+        errno = 0;
+        if ((e = ds_next(&ds)) == NULL) {
+            if (errno) rc = -1;
+            break;
+        }
+        nread++;
+        if (listing_add(&ls, e->d_name, strlen(e->d_name), e->d_type) == -1) {
+            what = "listing";
+            rc = -1;
+            break;
+        }
+        if (ls.used * per_byte + (size_t)ls.n * per_entry > mem_budget) {
+            what = "spill";
+            if ((sp.fd == -1 && spill_open(&sp) == -1) || spill_run(&sp, &ls) == -1) {
+                rc = -1;
+                break;
+            }
+        }
+    }
+    if (rc == 0 && sp.fd == -1) {
+        listing_sort(&ls);
+        display_listing(&ls, mode);
+    } else if (rc == 0) {
+        what = "spill";
+        if (ls.n > 0 && spill_run(&sp, &ls) == -1) rc = -1;
+        if (rc == 0 && merge_runs(&sp, &ls, mode) == -1) rc = -1;
+    }
+    if (rc == -1) out_perror(what);
+
+    ls.dirfd = -1;
+    listing_free(&ls);
+    spill_close(&sp);
+    ds_close(&ds);
+    STAT_ADD(dirs, 1);
+    STAT_ADD(entries, nread);
+    return rc;
+}
+
+/* ---------------- metadata cache ---------------- */
+
+/* --cache=FILE keeps sorted listings and their metadata across runs. Each
+ * directory's record holds its entry_t array, struct stat slots and name
+ * slab exactly as they are laid out in memory, keyed by the directory's
+ * (dev, ino) and valid while its mtime, its ctime and the options that
+ * shaped the listing (sort order, statx mask) are unchanged. The previous
+ * file is mapped privately at startup; a directory whose single fstat()
+ * still matches gets a listing that points into the mapping instead of
+ * being read, stat'ed and sorted again. Each run writes a new file with
+ * the directories it listed, carries the other records over, and renames
+ * it into place.
+ *
+ * A directory's mtime only moves when entries are added, removed or
+ * renamed, so metadata of files changed in place is served stale: this is
+ * for trees that are mostly static. Directories changed in the last two
+ * seconds are not stored, since a later change could keep the same time. */
+#define CACHE_MAGIC   0x3143534cU   /* "LSC1" */
+#define CACHE_VERSION 1
+
+typedef struct {
+    uint32_t magic, version;
+    uint32_t stat_size, entry_size;   /* records are only valid on this ABI */
+    uint64_t ndirs, index_off;
+} cache_hdr_t;
+
+typedef struct {
+    uint64_t dev, ino;
+    int64_t  mtime, mtime_nsec, ctime, ctime_nsec;
+    uint64_t params;
+    uint64_t n, names_len;
+} cache_rec_t;   /* then entry_t[n], struct stat[n], names; padded to 8 */
+
+typedef struct {
+    uint64_t dev, ino, off;   /* off 0: empty slot */
+} cache_idx_t;
+
+static struct {
+    const char  *path;       /* NULL: no cache */
+    char        *tmp_path;
+    char        *map;        /* previous file */
+    size_t       map_len;
+    cache_idx_t *idx;        /* its records, open-addressed by (dev, ino) */
+    char        *replaced;   /* per idx slot: rewritten by this run */
+    size_t       idx_cap;
+    spill_t      out;        /* the new file */
+    cache_idx_t *written;
+    size_t       nwritten, wcap;
+    uint64_t     params;
+    time_t       start;
+} cache = { .out = { .fd = -1 } };
+
+static size_t cache_rec_size(const cache_rec_t *r) {
+    size_t sz = sizeof(cache_rec_t) + r->n * (sizeof(entry_t) + sizeof(struct stat)) + r->names_len;
+    return (sz + 7) & ~(size_t)7;
+}
+
+/* slot of (dev, ino) in the index of the previous file, or -1 */
+long cache_find(uint64_t dev, uint64_t ino) {
+    if (!cache.idx) return -1;
+    size_t h = devino_hash(dev, ino, cache.idx_cap);
+    while (cache.idx[h].off) {
+        if (cache.idx[h].ino == ino && cache.idx[h].dev == dev) return (long)h;
+        h = (h + 1) & (cache.idx_cap - 1);
+    }
+    return -1;
+}
+
+/* map FILE and index its records; a missing or foreign file is ignored */
+void cache_load(void) {
+    int fd = open(cache.path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(cache_hdr_t)) { close(fd); return; }
+    cache.map_len = (size_t)st.st_size;
+    cache.map = mmap(NULL, cache.map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (cache.map == MAP_FAILED) { cache.map = NULL; return; }
+
+    const cache_hdr_t *h = (const cache_hdr_t *)cache.map;
+    if (h->magic != CACHE_MAGIC || h->version != CACHE_VERSION ||
+        h->stat_size != sizeof(struct stat) || h->entry_size != sizeof(entry_t) ||
+        h->index_off > cache.map_len ||
+        h->index_off < sizeof(cache_hdr_t) + sizeof(cache_rec_t) ||
+        h->ndirs > (cache.map_len - h->index_off) / sizeof(cache_idx_t)) return;
+    size_t cap = 64;
+    while (cap < h->ndirs * 2) cap *= 2;
+    cache.idx = calloc(cap, sizeof(cache_idx_t));
+    cache.replaced = calloc(cap, 1);
+    if (!cache.idx || !cache.replaced) {
+        free(cache.idx); free(cache.replaced);
+        cache.idx = NULL; cache.replaced = NULL;
+        return;
+    }
+    cache.idx_cap = cap;
+    const cache_idx_t *src = (const cache_idx_t *)(cache.map + h->index_off);
+    for (uint64_t i = 0; i < h->ndirs; ++i) {
+        uint64_t off = src[i].off;
+        if (off < sizeof(cache_hdr_t) || off > h->index_off - sizeof(cache_rec_t) || off % 8) continue;
+        const cache_rec_t *r = (const cache_rec_t *)(cache.map + off);
+        if (r->n > INT_MAX || r->names_len > UINT32_MAX ||
+            cache_rec_size(r) > h->index_off - off) continue;
+        size_t slot = devino_hash(r->dev, r->ino, cap);
+        while (cache.idx[slot].off) slot = (slot + 1) & (cap - 1);
+        cache.idx[slot] = (cache_idx_t){ r->dev, r->ino, off };
+    }
+}
+
+/* Start a run: load the previous file and open the new one beside it */
+void cache_open(const char *path) {
+    cache.path = path;
+    cache.start = time(NULL);
+    cache.params = (uint64_t)sort_by | (uint64_t)sort_reverse << 4 |
+                   (uint64_t)collate_enabled << 5 | (uint64_t)meta_mask << 32;
+    cache_load();
+
+    size_t len = strlen(path) + 32;
+    cache.tmp_path = malloc(len);
+    cache.out.buf = malloc(SPILL_BUF);
+    if (cache.tmp_path && cache.out.buf) {
+        cache.out.fd = create_beside(path, cache.tmp_path, len);
+    }
+    cache_hdr_t h = { 0 };
+    if (cache.out.fd == -1 || spill_put(&cache.out, &h, sizeof(h)) == -1) {
+        perror(path);
+        if (cache.out.fd != -1) unlink(cache.tmp_path);
+        spill_close(&cache.out);
+        cache.out.fd = -1;
+        cache.out.buf = NULL;
+    }
+}
+
+/* whether every entry of r names a NUL-terminated string of its slab and
+ * a slot of its stat array, so a damaged file cannot send a listing
+ * outside the mapping */
+int cache_rec_valid(const cache_rec_t *r) {
+    const entry_t *ents = (const entry_t *)(r + 1);
+    const char *slab = (const char *)((const struct stat *)(ents + r->n) + r->n);
+    for (uint64_t i = 0; i < r->n; ++i) {
+        const entry_t *e = &ents[i];
+        if (e->slot >= r->n || e->off >= r->names_len ||
+            e->len >= r->names_len - e->off || slab[e->off + e->len] != '\0')
+            return 0;
+    }
+    return 1;
+}
+
+/* A listing of the open directory fd served from the cache; -1 on a miss */
+int cache_lookup(int fd, const struct stat *dst, listing_t *ls) {
+    long slot = cache_find(dst->st_dev, dst->st_ino);
+    if (slot == -1) return -1;
+    cache_rec_t *r = (cache_rec_t *)(cache.map + cache.idx[slot].off);
+    if (r->params != cache.params ||
+        r->mtime != dst->st_mtim.tv_sec || r->mtime_nsec != dst->st_mtim.tv_nsec ||
+        r->ctime != dst->st_ctim.tv_sec || r->ctime_nsec != dst->st_ctim.tv_nsec ||
+        !cache_rec_valid(r))
+        return -1;
+    listing_init(ls);
+    ls->ents = (entry_t *)(r + 1);
+    ls->st = (struct stat *)(ls->ents + r->n);
+    ls->slab = (char *)(ls->st + r->n);
+    ls->n = ls->ecap = (int)r->n;
+    ls->st_cap = r->n;
+    ls->used = ls->cap = r->names_len;
+    ls->mapped = 1;
+    ls->dirfd = fd;
+    STAT_ADD(cache_hits, 1);
+    STAT_ADD(dirs, 1);
+    STAT_ADD(entries, r->n);
+    return 0;
+}
+
+/* Open name relative to dirfd and list it, from the cache when it is
+ * still valid; otherwise like read_listing_at() */
+int listing_load_at(int dirfd, const char *name, listing_t *ls) {
+    if (!cache.path || head_limit) return read_listing_at(dirfd, name, ls);
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    STAT_ADD(opens, 1);
+    if (fd == -1) return -1;
+    struct stat *dst = malloc(sizeof(*dst));
+    if (dst && fstat(fd, dst) == 0) {
+        if (cache_lookup(fd, dst, ls) == 0) {
+            free(dst);
+            return 0;
+        }
+    } else {
+        free(dst);
+        dst = NULL;
+    }
+    if (read_listing_fd(fd, ls) == -1) {
+        free(dst);
+        return -1;
+    }
+    ls->dirst = dst;
+    return 0;
+}
+
+int cache_put_index(uint64_t dev, uint64_t ino, uint64_t off) {
+    if (cache.nwritten == cache.wcap) {
+        size_t cap = cache.wcap ? cache.wcap * 2 : 256;
+        cache_idx_t *tmp = realloc(cache.written, sizeof(cache_idx_t) * cap);
+        if (!tmp) return -1;
+        cache.written = tmp;
+        cache.wcap = cap;
+    }
+    cache.written[cache.nwritten++] = (cache_idx_t){ dev, ino, off };
+    return 0;
 }
 
-int get_term_width(void) {
-    struct winsize ws;
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1) return 80;
-    return ws.ws_col ? ws.ws_col : 80;
+/* give up on writing the new file; the previous one stays in place */
+void cache_abandon(void) {
+    perror(cache.path);
+    unlink(cache.tmp_path);
+    spill_close(&cache.out);
+    cache.out.fd = -1;
+    cache.out.buf = NULL;
+}
+
+/* Append the listing of a printed directory to the new file */
+void cache_store(listing_t *ls) {
+    if (cache.out.fd == -1 || head_limit) return;
+    cache_rec_t r;
+    if (ls->mapped) {
+        r = ((cache_rec_t *)ls->ents)[-1];
+    } else {
+        const struct stat *d = ls->dirst;
+        if (!d || d->st_mtim.tv_sec >= cache.start - 1 || d->st_ctim.tv_sec >= cache.start - 1)
+            return;
+        r = (cache_rec_t){ d->st_dev, d->st_ino, d->st_mtim.tv_sec, d->st_mtim.tv_nsec,
+                           d->st_ctim.tv_sec, d->st_ctim.tv_nsec, cache.params,
+                           (uint64_t)ls->n, ls->used };
+    }
+    uint64_t off = (uint64_t)cache.out.size;
+    static const struct stat none;
+    int rc = spill_put(&cache.out, &r, sizeof(r));
+    if (rc == 0 && ls->n > 0) rc = spill_put(&cache.out, ls->ents, sizeof(entry_t) * ls->n);
+    if (ls->mapped) {
+        if (rc == 0 && ls->n > 0) rc = spill_put(&cache.out, ls->st, sizeof(struct stat) * ls->n);
+    } else {
+        /* slots never stat'ed hold no data: write zeros for them */
+        char *have = calloc(ls->n ? ls->n : 1, 1);
+        if (!have) rc = -1;
+        for (int i = 0; rc == 0 && i < ls->n; ++i)
+            if (ls->ents[i].flags & ENT_SLOT_USED) have[ls->ents[i].slot] = 1;
+        for (int i = 0; rc == 0 && i < ls->n; ++i)
+            rc = spill_put(&cache.out, have[i] ? &ls->st[i] : &none, sizeof(struct stat));
+        free(have);
+    }
+    if (rc == 0 && ls->used > 0) rc = spill_put(&cache.out, ls->slab, ls->used);
+    static const char pad[8];
+    size_t tail = (size_t)cache.out.size % 8;
+    if (rc == 0 && tail) rc = spill_put(&cache.out, pad, 8 - tail);
+    if (rc == 0) rc = cache_put_index(r.dev, r.ino, off);
+    if (rc == -1) { cache_abandon(); return; }
+    long slot = cache_find(r.dev, r.ino);
+    if (slot != -1) cache.replaced[slot] = 1;
 }
 
-int ends_with(const char *name, const char *suffix) {
-    if (!name || !suffix) return 0;
-    size_t nlen = strlen(name), slen = strlen(suffix);
-    if (slen > nlen) return 0;
-    return (strcmp(name + nlen - slen, suffix) == 0);
+/* Carry the untouched records over, write the index and replace FILE */
+void cache_finish(void) {
+    if (!cache.path) return;
+    int rc = cache.out.fd == -1 ? -1 : 0;
+    for (size_t i = 0; rc == 0 && i < cache.idx_cap; ++i) {
+        if (!cache.idx[i].off || cache.replaced[i]) continue;
+        const cache_rec_t *r = (const cache_rec_t *)(cache.map + cache.idx[i].off);
+        uint64_t off = (uint64_t)cache.out.size;
+        rc = spill_put(&cache.out, r, cache_rec_size(r));
+        if (rc == 0) rc = cache_put_index(r->dev, r->ino, off);
+    }
+    if (rc == 0) {
+        cache_hdr_t h = { CACHE_MAGIC, CACHE_VERSION, sizeof(struct stat), sizeof(entry_t),
+                          cache.nwritten, (uint64_t)cache.out.size };
+        if (cache.nwritten > 0)
+            rc = spill_put(&cache.out, cache.written, sizeof(cache_idx_t) * cache.nwritten);
+        if (rc == 0) rc = write_all(cache.out.fd, cache.out.buf, cache.out.len);
+        if (rc == 0 && pwrite(cache.out.fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) rc = -1;
+        if (rc == 0 && rename(cache.tmp_path, cache.path) == -1) rc = -1;
+        if (rc == -1) cache_abandon();
+        else spill_close(&cache.out);
+    }
+    if (cache.map) munmap(cache.map, cache.map_len);
+    free(cache.idx);
+    free(cache.replaced);
+    free(cache.written);
+    free(cache.tmp_path);
+    cache.path = NULL;
 }
 
-/* detect archive-like names */
-int is_archive_name(const char *name) {
-    if (!name) return 0;
-    if (ends_with(name, ".tar") || ends_with(name, ".tgz") ||
-        ends_with(name, ".tar.gz") || ends_with(name, ".gz") ||
-        ends_with(name, ".zip") ) return 1;
-    return 0;
+/* ---------------- tree snapshots ---------------- */
+
+/* --write-snapshot=FILE records every directory a run lists (the whole tree
+ * with -R) so that --snapshot=FILE can list it again later in any display
+ * mode without touching the file system. The file is meant to be mapped:
+ *
+ *   header | entry records | directory records | string table
+ *
+ * Records are fixed width and refer to names, paths and symlink targets by
+ * offset into the string table, whose strings are NUL-terminated (offset 0
+ * is the empty string, "none"). A directory's entries are contiguous. Every
+ * entry is stat'ed while writing, whatever the display mode, so the
+ * snapshot can serve -l, -t and -S as well as the short formats. */
+#define SNAP_MAGIC   0x3153534cU   /* "LSS1" */
+#define SNAP_VERSION 1
+
+typedef struct {
+    uint32_t magic, version;
+    uint32_t dir_size, ent_size;
+    uint64_t ndirs, nents;
+    uint64_t ents_off, dirs_off, strs_off, strs_len;
+} snap_hdr_t;
+
+typedef struct {
+    uint64_t path_off;
+    uint64_t first, n;          /* entries [first, first + n) */
+    uint64_t dev, ino;
+    int64_t  mtime, ctime;
+    uint32_t mtime_nsec, ctime_nsec;
+    int32_t  err;               /* errno if it could not be read, else 0 */
+    uint32_t flags;             /* SNAPDIR_* */
+} snap_dir_t;
+
+#define SNAPDIR_ROOT 0x01       /* a command-line operand */
+
+typedef struct {
+    uint64_t name_off, link_off;
+    uint64_t ino, size, blocks, rdev;
+    int64_t  mtime, ctime;
+    uint32_t mtime_nsec, ctime_nsec;
+    uint32_t mode, nlink, uid, gid;
+    uint32_t name_len;
+    uint8_t  type, flags;       /* DT_*, ENT_HAVE_STAT or ENT_STAT_FAILED */
+    uint16_t err;               /* errno when ENT_STAT_FAILED */
+} snap_ent_t;
+
+static struct {
+    const char *path;           /* NULL: not writing */
+    char       *tmp_path;
+    spill_t     file;           /* entries go straight to the file */
+    spill_t     strs;           /* string table, in a temp file until the end */
+    snap_dir_t *dirs;
+    size_t      ndirs, dcap;
+    uint64_t    nents;
+} snap_out = { .file = { .fd = -1 }, .strs = { .fd = -1 } };
+
+/* drop the snapshot being written; FILE is left as it was */
+void snapshot_abandon(void) {
+    perror(snap_out.path);
+    if (snap_out.file.fd != -1) unlink(snap_out.tmp_path);
+    spill_close(&snap_out.file);
+    spill_close(&snap_out.strs);
+    memset(&snap_out.file, 0, sizeof(snap_out.file));
+    memset(&snap_out.strs, 0, sizeof(snap_out.strs));
+    snap_out.file.fd = snap_out.strs.fd = -1;
+}
+
+/* append s to the string table; returns its offset, 0 on error */
+uint64_t snapshot_str(const char *s, size_t len, int *rc) {
+    uint64_t off = (uint64_t)snap_out.strs.size;
+    if (*rc == 0) *rc = spill_put(&snap_out.strs, s, len);
+    if (*rc == 0) *rc = spill_put(&snap_out.strs, "", 1);
+    return *rc == 0 ? off : 0;
+}
+
+void snapshot_open_out(const char *path) {
+    snap_out.path = path;
+    size_t len = strlen(path) + 32;
+    snap_out.tmp_path = malloc(len);
+    snap_out.file.buf = malloc(SPILL_BUF);
+    int rc = -1;
+    if (snap_out.tmp_path && snap_out.file.buf) {
+        snap_out.file.fd = create_beside(path, snap_out.tmp_path, len);
+        if (snap_out.file.fd != -1 && spill_open(&snap_out.strs) == 0) {
+            snap_hdr_t h = { 0 };
+            rc = spill_put(&snap_out.file, &h, sizeof(h));
+            snapshot_str("", 0, &rc);
+        }
+    }
+    if (rc == -1) snapshot_abandon();
 }
 
-/* read directory names (skip . and ..) */
-char **read_dir_names(const char *dirpath, int *count) {
-    DIR *dir = opendir(dirpath);
-    if (!dir) { perror("opendir"); *count = 0; return NULL; }
-    struct dirent *e;
-    int cap = 64, n = 0;
-    char **arr = malloc(sizeof(char*) * cap);
-    if (!arr) { closedir(dir); *count = 0; return NULL; }
-    while ((e = readdir(dir)) != NULL) {
-        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
-        if (n >= cap) {
-            cap *= 2;
-            char **tmp = realloc(arr, sizeof(char*) * cap);
-            if (!tmp) { perror("realloc"); for (int i=0;i<n;i++) free(arr[i]); free(arr); closedir(dir); *count=0; return NULL; }
-            arr = tmp;
+/* Record a listed directory: its own metadata from its fd, then each
+ * entry in ls (NULL when it could not be read, with err set) */
+void snapshot_store(const char *path, listing_t *ls, int err, int root) {
+    if (snap_out.file.fd == -1) return;
+    if (snap_out.ndirs == snap_out.dcap) {
+        size_t cap = snap_out.dcap ? snap_out.dcap * 2 : 256;
+        snap_dir_t *tmp = realloc(snap_out.dirs, sizeof(snap_dir_t) * cap);
+        if (!tmp) { snapshot_abandon(); return; }
+        snap_out.dirs = tmp;
+        snap_out.dcap = cap;
+    }
+    int rc = 0;
+    snap_dir_t d = { 0 };
+    d.path_off = snapshot_str(path, strlen(path), &rc);
+    d.first = snap_out.nents;
+    d.err = err;
+    d.flags = root ? SNAPDIR_ROOT : 0;
+    struct stat dst;
+    const struct stat *ds = NULL;
+    if (ls) ds = ls->dirst ? ls->dirst : fstat(ls->dirfd, &dst) == 0 ? &dst : NULL;
+    if (ds) {
+        d.dev = ds->st_dev;
+        d.ino = ds->st_ino;
+        d.mtime = ds->st_mtim.tv_sec;
+        d.mtime_nsec = (uint32_t)ds->st_mtim.tv_nsec;
+        d.ctime = ds->st_ctim.tv_sec;
+        d.ctime_nsec = (uint32_t)ds->st_ctim.tv_nsec;
+    }
+    for (int i = 0; ls && rc == 0 && i < ls->n; ++i) {
+        entry_t *e = &ls->ents[i];
+        const char *name = ENT_NAME(ls, e);
+        const struct stat *st = entry_stat(ls, e);
+        snap_ent_t r = { 0 };
+        r.name_off = snapshot_str(name, e->len, &rc);
+        r.name_len = e->len;
+        r.type = e->type;
+        r.flags = st ? ENT_HAVE_STAT : ENT_STAT_FAILED;
+        r.err = st ? 0 : (uint16_t)errno;
+        if (st) {
+            r.ino = st->st_ino;
+            r.size = (uint64_t)st->st_size;
+            r.blocks = (uint64_t)st->st_blocks;
+            r.rdev = st->st_rdev;
+            r.mtime = st->st_mtim.tv_sec;
+            r.mtime_nsec = (uint32_t)st->st_mtim.tv_nsec;
+            r.ctime = st->st_ctim.tv_sec;
+            r.ctime_nsec = (uint32_t)st->st_ctim.tv_nsec;
+            r.mode = st->st_mode;
+            r.nlink = (uint32_t)st->st_nlink;
+            r.uid = st->st_uid;
+            r.gid = st->st_gid;
+        }
+        if (st && S_ISLNK(st->st_mode)) {
+            char target[PATH_MAX];
+            STAT_ADD(readlinks, 1);
+            ssize_t len = readlinkat(ls->dirfd, name, target, sizeof(target) - 1);
+            if (len > 0) r.link_off = snapshot_str(target, (size_t)len, &rc);
         }
-        arr[n++] = strdup(e->d_name);
+        if (rc == 0) rc = spill_put(&snap_out.file, &r, sizeof(r));
+        d.n++;
+    }
+    if (rc == -1) { snapshot_abandon(); return; }
+    snap_out.nents += d.n;
+    snap_out.dirs[snap_out.ndirs++] = d;
+}
+
+/* Append the directory table and the string table, fill in the header and
+ * move the file into place; -1 if the snapshot could not be written */
+int snapshot_finish(void) {
+    if (!snap_out.path) return 0;
+    int rc = snap_out.file.fd == -1 ? -1 : 0;
+    snap_hdr_t h = { SNAP_MAGIC, SNAP_VERSION, sizeof(snap_dir_t), sizeof(snap_ent_t),
+                     snap_out.ndirs, snap_out.nents, sizeof(snap_hdr_t), 0, 0, 0 };
+    if (rc == 0) {
+        h.dirs_off = (uint64_t)snap_out.file.size;
+        if (snap_out.ndirs > 0)
+            rc = spill_put(&snap_out.file, snap_out.dirs, sizeof(snap_dir_t) * snap_out.ndirs);
+        if (rc == 0) rc = write_all(snap_out.file.fd, snap_out.file.buf, snap_out.file.len);
+        snap_out.file.len = 0;
+        h.strs_off = (uint64_t)snap_out.file.size;
+        h.strs_len = (uint64_t)snap_out.strs.size;
+    }
+    if (rc == 0) rc = write_all(snap_out.strs.fd, snap_out.strs.buf, snap_out.strs.len);
+    for (off_t off = 0; rc == 0 && off < snap_out.strs.size; ) {
+        ssize_t got = pread(snap_out.strs.fd, snap_out.file.buf, SPILL_BUF, off);
+        if (got <= 0) { if (got == 0) errno = EIO; rc = -1; break; }
+        rc = write_all(snap_out.file.fd, snap_out.file.buf, (size_t)got);
+        off += got;
     }
-    closedir(dir);
-    *count = n;
-    return arr;
+    if (rc == 0 && pwrite(snap_out.file.fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) rc = -1;
+    if (rc == 0 && rename(snap_out.tmp_path, snap_out.path) == -1) rc = -1;
+    if (rc == -1 && snap_out.file.fd != -1) snapshot_abandon();
+    spill_close(&snap_out.file);
+    spill_close(&snap_out.strs);
+    free(snap_out.dirs);
+    free(snap_out.tmp_path);
+    snap_out.path = NULL;
+    return rc;
 }
 
-void free_names(char **names, int n) {
-    if (!names) return;
-    for (int i = 0; i < n; ++i) free(names[i]);
-    free(names);
+/* A snapshot mapped for reading, with its directories hashed by path */
+typedef struct {
+    char             *map;
+    size_t            len;
+    const snap_dir_t *dirs;
+    const snap_ent_t *ents;
+    const char       *strs;
+    uint64_t          ndirs, nents, strs_len;
+    uint64_t         *idx;      /* directory index + 1, 0: empty */
+    size_t            idx_cap;
+} snapshot_t;
+
+static size_t snapshot_hash(const char *path, size_t cap) {
+    uint64_t h = 0xcbf29ce484222325ULL;   /* FNV-1a */
+    for (const unsigned char *p = (const unsigned char *)path; *p; ++p)
+        h = (h ^ *p) * 0x100000001b3ULL;
+    return (size_t)(h ^ h >> 32) & (cap - 1);
 }
 
-/* ---------------- color decision ---------------- */
+#define SNAP_STR(s, off) ((s)->strs + (off))
 
-const char* choose_color_for(const char *fullpath, const char *name) {
+/* index of the directory recorded under path, or -1 */
+long snapshot_find(const snapshot_t *s, const char *path) {
+    size_t h = snapshot_hash(path, s->idx_cap);
+    while (s->idx[h]) {
+        const snap_dir_t *d = &s->dirs[s->idx[h] - 1];
+        if (strcmp(SNAP_STR(s, d->path_off), path) == 0) return (long)(s->idx[h] - 1);
+        h = (h + 1) & (s->idx_cap - 1);
+    }
+    return -1;
+}
+
+void snapshot_close(snapshot_t *s) {
+    if (s->map) munmap(s->map, s->len);
+    free(s->idx);
+    memset(s, 0, sizeof(*s));
+}
+
+/* Map and check a snapshot: every offset it holds is validated here, so
+ * readers can trust the records. -1 with errno set on failure. */
+int snapshot_load(snapshot_t *s, const char *path) {
+    memset(s, 0, sizeof(*s));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
     struct stat st;
-    if (lstat(fullpath, &st) == -1) {
-        return ""; /* fallback: no color */
+    if (fstat(fd, &st) == -1) { close(fd); return -1; }
+    s->len = (size_t)st.st_size;
+    s->map = s->len >= sizeof(snap_hdr_t) ?
+             mmap(NULL, s->len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (s->map == MAP_FAILED) { s->map = NULL; errno = EINVAL; return -1; }
+
+    const snap_hdr_t *h = (const snap_hdr_t *)s->map;
+    if (h->magic != SNAP_MAGIC || h->version != SNAP_VERSION ||
+        h->dir_size != sizeof(snap_dir_t) || h->ent_size != sizeof(snap_ent_t) ||
+        h->ents_off != sizeof(snap_hdr_t) ||
+        h->nents > (s->len - h->ents_off) / sizeof(snap_ent_t) ||
+        h->dirs_off != h->ents_off + h->nents * sizeof(snap_ent_t) ||
+        h->ndirs > (s->len - h->dirs_off) / sizeof(snap_dir_t) ||
+        h->strs_off != h->dirs_off + h->ndirs * sizeof(snap_dir_t) ||
+        h->strs_len == 0 || h->strs_len != s->len - h->strs_off ||
+        s->map[s->len - 1] != '\0')
+        goto corrupt;
+    s->dirs = (const snap_dir_t *)(s->map + h->dirs_off);
+    s->ents = (const snap_ent_t *)(s->map + h->ents_off);
+    s->strs = s->map + h->strs_off;
+    s->ndirs = h->ndirs;
+    s->nents = h->nents;
+    s->strs_len = h->strs_len;
+    for (uint64_t i = 0; i < s->nents; ++i) {
+        const snap_ent_t *e = &s->ents[i];
+        if (e->name_off >= s->strs_len || e->link_off >= s->strs_len ||
+            e->name_len != strlen(SNAP_STR(s, e->name_off)))
+            goto corrupt;
+    }
+
+    size_t cap = 64;
+    while (cap < s->ndirs * 2) cap *= 2;
+    s->idx = calloc(cap, sizeof(uint64_t));
+    if (!s->idx) { snapshot_close(s); errno = ENOMEM; return -1; }
+    s->idx_cap = cap;
+    for (uint64_t i = 0; i < s->ndirs; ++i) {
+        const snap_dir_t *d = &s->dirs[i];
+        if (d->path_off >= s->strs_len || d->first > s->nents || d->n > s->nents - d->first)
+            goto corrupt;
+        size_t slot = snapshot_hash(SNAP_STR(s, d->path_off), cap);
+        while (s->idx[slot]) slot = (slot + 1) & (cap - 1);
+        s->idx[slot] = i + 1;
     }
+    return 0;
 
-    if (S_ISLNK(st.st_mode)) return MAGENTA;
-    if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) || S_ISSOCK(st.st_mode) || S_ISFIFO(st.st_mode))
-        return REVERSE;
-    if (S_ISDIR(st.st_mode)) return BLUE;
-    if (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) return GREEN;
-    if (is_archive_name(name)) return RED;
-    return ""; /* no color */
+corrupt:
+    snapshot_close(s);
+    errno = EINVAL;
+    return -1;
 }
 
-void print_colored_padded(const char *dirpath, const char *name, int pad, int last) {
-    char full[PATH_MAX];
-    if (snprintf(full, sizeof(full), "%s/%s", dirpath, name) >= (int)sizeof(full)) {
-        /* path too long: fallback to printing name */
-        if (!color_enabled) {
-            printf("%s", name);
-        } else {
-            printf("%s%s%s", "", name, RESET);
+/* the entries of snapshot directory d as a listing, in recorded order */
+int snapshot_listing(const snapshot_t *s, const snap_dir_t *d, listing_t *ls) {
+    listing_init(ls);
+    if (d->n > INT_MAX) { errno = EOVERFLOW; return -1; }
+    size_t n = d->n ? d->n : 1;
+    ls->st = malloc(sizeof(struct stat) * n);
+    ls->links = calloc(n, sizeof(char *));
+    if (!ls->st || !ls->links) goto fail;
+    ls->st_cap = n;
+    for (uint64_t i = 0; i < d->n; ++i) {
+        const snap_ent_t *r = &s->ents[d->first + i];
+        if (listing_add(ls, SNAP_STR(s, r->name_off), r->name_len, r->type) == -1) goto fail;
+        entry_t *e = &ls->ents[ls->n - 1];
+        e->flags = r->flags & (ENT_HAVE_STAT | ENT_STAT_FAILED);
+        struct stat *st = ENT_STAT(ls, e);
+        memset(st, 0, sizeof(*st));
+        st->st_dev = d->dev;
+        st->st_ino = r->ino;
+        st->st_mode = r->mode;
+        st->st_nlink = r->nlink;
+        st->st_uid = r->uid;
+        st->st_gid = r->gid;
+        st->st_rdev = r->rdev;
+        st->st_size = (off_t)r->size;
+        st->st_blocks = (blkcnt_t)r->blocks;
+        st->st_mtim.tv_sec = r->mtime;
+        st->st_mtim.tv_nsec = r->mtime_nsec;
+        st->st_ctim.tv_sec = r->ctime;
+        st->st_ctim.tv_nsec = r->ctime_nsec;
+        if (r->link_off) ls->links[e->slot] = SNAP_STR(s, r->link_off);
+        if (e->flags & ENT_STAT_FAILED) st->st_blksize = r->err;
+    }
+    return 0;
+
+fail:
+    listing_free(ls);
+    errno = ENOMEM;
+    return -1;
+}
+
+/* ---------------- disk usage ---------------- */
+
+/* --du (-s) adds up allocated blocks and apparent sizes while -R walks, from
+ * the metadata the listing already fetched. Each listing starts with GNU's
+ * "total N" line (1K blocks of the entries shown). Every directory's own
+ * entries are added to its node when it is printed, and a node's totals
+ * are added to its parent's when the walk pops it, so an operand's totals
+ * are complete once its subtree is done. The rolled-up totals count each
+ * file with several hard links once, through a set of (dev, ino) pairs. */
+typedef struct {
+    unsigned long long blocks;   /* 512-byte units */
+    unsigned long long bytes;
+    unsigned long long files, dirs;
+} du_t;
+
+static du_t du_grand;
+
+static struct {
+    devino_t *slots;   /* ino 0 marks an empty slot */
+    size_t    cap, n;
+} seen_links;
+
+/* 1 if (dev, ino) was already counted, else records it and returns 0 */
+int devino_seen(uint64_t dev, uint64_t ino) {
+    if (ino == 0) return 0;
+    if (seen_links.n * 2 >= seen_links.cap) {
+        size_t cap = seen_links.cap ? seen_links.cap * 2 : 1024;
+        devino_t *slots = calloc(cap, sizeof(devino_t));
+        if (!slots) return 0;   /* count it again rather than fail */
+        for (size_t i = 0; i < seen_links.cap; ++i) {
+            devino_t *d = &seen_links.slots[i];
+            if (d->ino == 0) continue;
+            size_t h = devino_hash(d->dev, d->ino, cap);
+            while (slots[h].ino) h = (h + 1) & (cap - 1);
+            slots[h] = *d;
         }
-        if (!last && pad > 0) printf("%*s", pad - (int)strlen(name), "");
+        free(seen_links.slots);
+        seen_links.slots = slots;
+        seen_links.cap = cap;
+    }
+    size_t h = devino_hash(dev, ino, seen_links.cap);
+    while (seen_links.slots[h].ino) {
+        if (seen_links.slots[h].ino == ino && seen_links.slots[h].dev == dev) return 1;
+        h = (h + 1) & (seen_links.cap - 1);
+    }
+    seen_links.slots[h] = (devino_t){ dev, ino };
+    seen_links.n++;
+    return 0;
+}
+
+void du_add_stat(du_t *du, const struct stat *st) {
+    if (!S_ISDIR(st->st_mode) && st->st_nlink > 1 && devino_seen(st->st_dev, st->st_ino))
         return;
+    du->blocks += (unsigned long long)st->st_blocks;
+    du->bytes += (unsigned long long)st->st_size;
+    if (S_ISDIR(st->st_mode)) du->dirs++;
+    else du->files++;
+}
+
+void du_merge(du_t *into, const du_t *from) {
+    into->blocks += from->blocks;
+    into->bytes += from->bytes;
+    into->files += from->files;
+    into->dirs += from->dirs;
+}
+
+/* "total N" for a listing and its entries' share of du */
+void du_listing(listing_t *ls, du_t *du) {
+    unsigned long long blocks = 0;
+    for (int i = 0; i < ls->n; ++i) {
+        const struct stat *st = entry_stat(ls, &ls->ents[i]);
+        if (!st) continue;
+        blocks += (unsigned long long)st->st_blocks;
+        du_add_stat(du, st);
     }
+    out_str("total ");
+    out_int((long long)((blocks + 1) / 2), 0);
+    out_char('\n');
+}
 
-    const char *start = "";
-    if (color_enabled) start = choose_color_for(full, name);
+/* "<label> N (B bytes apparent, F files, D directories)" */
+void du_print(const char *label, const du_t *du) {
+    out_str(label);
+    out_char(' ');
+    out_int((long long)((du->blocks + 1) / 2), 0);
+    out_str(" (");
+    out_int((long long)du->bytes, 0);
+    out_str(" bytes apparent, ");
+    out_int((long long)du->files, 0);
+    out_str(du->files == 1 ? " file, " : " files, ");
+    out_int((long long)du->dirs, 0);
+    out_str(du->dirs == 1 ? " directory)\n" : " directories)\n");
+}
 
-    if (color_enabled && start && start[0] != '\0') {
-        printf("%s%s%s", start, name, RESET);
+/* ---------------- parallel directory scanning ---------------- */
+
+/* A directory of the -R walk. Nodes are scanned (read, sorted, stat'ed,
+ * children discovered) by whichever thread claims them first, but only the
+ * main thread prints, in the same depth-first order as a serial walk.
+ *
+ * Directories are opened with openat() relative to their parent's fd, so
+ * the path is only built once per directory for its header and depth is
+ * not limited by PATH_MAX. A node keeps its fd while it is waiting to be
+ * printed and, within FD_BUDGET, until all of its subdirectories have
+ * been opened; past the budget children reopen their parent by walking
+ * down from the nearest ancestor that still has an fd. */
+enum { NODE_PENDING = 0, NODE_RUNNING, NODE_DONE };
+
+typedef struct dnode {
+    struct dnode  *parent;
+    char          *path;    /* header text; the root is opened by it */
+    const char    *name;    /* last component, points into path */
+    listing_t      ls;      /* borrows fd while the node is unprinted */
+    int            err;     /* errno from reading, 0 on success */
+    int            state;   /* NODE_*, accessed atomically */
+    int            refs;    /* walk + work queue references */
+    int            fd;      /* open directory or -1, guarded by fd_lock */
+    int            fd_users;   /* printer + children still to be opened */
+    int            kids_hold;  /* fd kept open for the children */
+    struct dnode **kids;    /* subdirectories in display order */
+    int            nkids;
+    du_t           du;      /* --du: subtree totals, rolled up when popped */
+} dnode_t;
+
+#define FD_BUDGET 128     /* directories holding their fd for children */
+
+static pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER;
+static int fds_held = 0;
+static int fd_budget = FD_BUDGET;
+
+/* Per-worker deque: the owner pushes and pops at the bottom (newest, so it
+ * keeps descending the subtree it just discovered), thieves take from the
+ * top (oldest, i.e. the shallowest and usually largest subtrees). */
+typedef struct {
+    pthread_mutex_t lock;
+    dnode_t       **items;
+    int             top, bottom, cap;
+} wsdeque_t;
+
+#define AHEAD_MAX 256     /* scanned but not yet printed directories */
+static int ahead_max = AHEAD_MAX;
+#define THREADS_MAX 256
+#define OPERAND_THREADS 8 /* default readers for several directory operands */
+
+static struct {
+    int             nthreads;   /* worker threads; 0 means scan inline */
+    pthread_t      *threads;
+    wsdeque_t      *deques;
+    pthread_mutex_t lock;       /* guards queued, ahead, stop */
+    pthread_cond_t  cond;
+    int             queued;     /* items in all deques not yet reserved */
+    int             ahead;
+    int             stop;
+    display_mode_t  mode;
+    int             recursive;  /* discover and walk subdirectories */
+} pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static __thread int worker_id = -1;
+
+dnode_t *dnode_new(dnode_t *parent, char *path) {
+    dnode_t *nd = calloc(1, sizeof(*nd));
+    if (!nd) { free(path); return NULL; }
+    nd->parent = parent;
+    nd->path = path;
+    nd->name = parent ? path + strlen(parent->path) + 1 : path;
+    nd->refs = 1;
+    nd->fd = -1;
+    listing_init(&nd->ls);
+    return nd;
+}
+
+/* drop one use of the node's fd, closing it with the last one */
+void dnode_fd_put(dnode_t *nd) {
+    if (__atomic_sub_fetch(&nd->fd_users, 1, __ATOMIC_ACQ_REL) > 0) return;
+    pthread_mutex_lock(&fd_lock);
+    int fd = nd->fd;
+    nd->fd = -1;
+    if (nd->kids_hold) fds_held--;
+    pthread_mutex_unlock(&fd_lock);
+    if (fd != -1) close(fd);
+}
+
+/* Open a private fd for nd when it did not keep its own: descend from the
+ * nearest ancestor with an open fd (or from the root's path), one
+ * component at a time, so the walk never depends on the path length. */
+int dnode_reopen(dnode_t *nd) {
+    int depth = 0, cap = 16;
+    dnode_t **chain = malloc(sizeof(dnode_t *) * cap);
+    if (!chain) return -1;
+
+    pthread_mutex_lock(&fd_lock);
+    dnode_t *a = nd;
+    while (a->fd == -1 && a->parent) {
+        if (depth == cap) {
+            dnode_t **tmp = realloc(chain, sizeof(dnode_t *) * (cap *= 2));
+            if (!tmp) { pthread_mutex_unlock(&fd_lock); free(chain); return -1; }
+            chain = tmp;
+        }
+        chain[depth++] = a;
+        a = a->parent;
+    }
+    int fd;
+    if (a->fd != -1)
+        fd = openat(a->fd, depth ? chain[--depth]->name : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    else
+        fd = open(a->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    pthread_mutex_unlock(&fd_lock);
+    STAT_ADD(opens, 1);
+
+    while (fd != -1 && depth > 0) {
+        int next = openat(fd, chain[--depth]->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        STAT_ADD(opens, 1);
+        int err = errno;
+        close(fd);
+        errno = err;
+        fd = next;
+    }
+    free(chain);
+    return fd;
+}
+
+void dnode_unref(dnode_t *nd) {
+    if (__atomic_sub_fetch(&nd->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    if (nd->ls.dirfd == nd->fd) nd->ls.dirfd = -1;
+    if (nd->fd != -1) close(nd->fd);
+    listing_free(&nd->ls);
+    free(nd->kids);
+    free(nd->path);
+    free(nd);
+}
+
+char *path_join(const char *dir, const char *name) {
+    size_t dl = strlen(dir), nl = strlen(name);
+    char *p = malloc(dl + nl + 2);
+    if (!p) return NULL;
+    memcpy(p, dir, dl);
+    p[dl] = '/';
+    memcpy(p + dl + 1, name, nl + 1);
+    return p;
+}
+
+/* -1 if the deque could not grow */
+int wsdeque_push(wsdeque_t *dq, dnode_t *nd) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom == dq->cap) {
+        /* compact, then grow if still full */
+        int live = dq->bottom - dq->top;
+        if (live > 0 && dq->top > 0)
+            memmove(dq->items, dq->items + dq->top, sizeof(dnode_t *) * live);
+        dq->top = 0;
+        dq->bottom = live;
+        if (live == dq->cap) {
+            int cap = dq->cap ? dq->cap * 2 : 64;
+            dnode_t **tmp = realloc(dq->items, sizeof(dnode_t *) * cap);
+            if (!tmp) { pthread_mutex_unlock(&dq->lock); return -1; }
+            dq->items = tmp;
+            dq->cap = cap;
+        }
+    }
+    dq->items[dq->bottom++] = nd;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+dnode_t *wsdeque_pop(wsdeque_t *dq) {
+    dnode_t *nd = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top) nd = dq->items[--dq->bottom];
+    pthread_mutex_unlock(&dq->lock);
+    return nd;
+}
+
+dnode_t *wsdeque_steal(wsdeque_t *dq) {
+    dnode_t *nd = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top) nd = dq->items[dq->top++];
+    pthread_mutex_unlock(&dq->lock);
+    return nd;
+}
+
+/* Offer nodes to the workers, last first so the owner's LIFO pops follow
+ * the order the printer will ask for them. Nodes that do not fit in the
+ * deque stay pending and the printer scans them itself in dnode_wait(). */
+void pool_offer(dnode_t **nodes, int n) {
+    if (pool.nthreads == 0 || n == 0) return;
+    int me = worker_id >= 0 ? worker_id : 0, pushed = 0;
+    for (int i = n - 1; i >= 0; --i, ++pushed) {
+        __atomic_add_fetch(&nodes[i]->refs, 1, __ATOMIC_RELAXED);
+        if (wsdeque_push(&pool.deques[me], nodes[i]) == -1) {
+            __atomic_sub_fetch(&nodes[i]->refs, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    if (pushed == 0) return;
+    pthread_mutex_lock(&pool.lock);
+    pool.queued += pushed;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Read one directory relative to its parent, discover its subdirectories
+ * and decide whether its fd stays open for them */
+void scan_node(dnode_t *nd, display_mode_t mode) {
+    int rc, err;
+    dnode_t *p = nd->parent;
+    if (!p) {
+        rc = listing_load_at(AT_FDCWD, nd->path, &nd->ls);
+        err = errno;
+    } else if (p->kids_hold) {
+        rc = listing_load_at(p->fd, nd->name, &nd->ls);
+        err = errno;
+        dnode_fd_put(p);
     } else {
-        printf("%s", name);
+        int pfd = dnode_reopen(p);
+        rc = pfd == -1 ? -1 : listing_load_at(pfd, nd->name, &nd->ls);
+        err = errno;
+        if (pfd != -1) close(pfd);
     }
+    if (rc == -1) {
+        nd->err = err;
+    } else {
+        listing_prefetch(&nd->ls, mode);
+        if (!nd->ls.mapped) listing_sort(&nd->ls);
+        int ndirs = 0;
+        for (int i = 0; pool.recursive && i < nd->ls.n; ++i)
+            if (nd->ls.ents[i].type == DT_DIR) ndirs++;
+        if (ndirs > 0) nd->kids = malloc(sizeof(dnode_t *) * ndirs);
+        for (int i = 0; nd->kids && i < nd->ls.n; ++i) {
+            entry_t *e = &nd->ls.ents[i];
+            if (e->type != DT_DIR) continue;
+            char *kpath = path_join(nd->path, ENT_NAME(&nd->ls, e));
+            dnode_t *kid = kpath ? dnode_new(nd, kpath) : NULL;
+            if (kid) nd->kids[nd->nkids++] = kid;
+        }
 
-    if (!last && pad > 0) {
-        int visible = (int)strlen(name); /* visible length */
-        int to_pad = pad - visible;
-        if (to_pad > 0) printf("%*s", to_pad, "");
+        nd->fd = nd->ls.dirfd;
+        nd->fd_users = 1;
+        if (nd->nkids > 0) {
+            pthread_mutex_lock(&fd_lock);
+            if (fds_held < fd_budget) {
+                fds_held++;
+                nd->kids_hold = 1;
+                nd->fd_users += nd->nkids;
+            }
+            pthread_mutex_unlock(&fd_lock);
+        }
+    }
+    pool_offer(nd->kids, nd->nkids);
+    __atomic_store_n(&nd->state, NODE_DONE, __ATOMIC_RELEASE);
+    if (pool.nthreads > 0) {
+        pthread_mutex_lock(&pool.lock);
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
     }
 }
 
-/* ---------------- display implementations ---------------- */
+/* claim a pending node for scanning; fails if another thread got it */
+int dnode_claim(dnode_t *nd) {
+    int expect = NODE_PENDING;
+    return __atomic_compare_exchange_n(&nd->state, &expect, NODE_RUNNING, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
 
-void print_columns_down_across(const char *dirpath, char **names, int n) {
-    (void)dirpath;  // suppress unused parameter warning
-    if (n <= 0) return;
-    int maxlen = 0;
-    for (int i = 0; i < n; ++i) {
-        int L = (int)strlen(names[i]);
-        if (L > maxlen) maxlen = L;
+void *pool_worker(void *arg) {
+    worker_id = (int)(intptr_t)arg;
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.stop && (pool.queued == 0 || pool.ahead >= ahead_max))
+            pthread_cond_wait(&pool.cond, &pool.lock);
+        if (pool.stop) { pthread_mutex_unlock(&pool.lock); break; }
+        pool.queued--;   /* reserves one queued node for this thread */
+        pthread_mutex_unlock(&pool.lock);
+
+        dnode_t *nd = wsdeque_pop(&pool.deques[worker_id]);
+        for (int i = 1; !nd; ++i)
+            nd = wsdeque_steal(&pool.deques[(worker_id + i) % pool.nthreads]);
+
+        if (dnode_claim(nd)) {
+            pthread_mutex_lock(&pool.lock);
+            pool.ahead++;
+            pthread_mutex_unlock(&pool.lock);
+            scan_node(nd, pool.mode);
+        }
+        dnode_unref(nd);
     }
-    int spacing = 2;
-    int colw = maxlen + spacing;
-    int termw = get_term_width();
-    int ncols = termw / colw;
-    if (ncols < 1) ncols = 1;
-    int nrows = (n + ncols - 1) / ncols;
+    dirbuf_release();
+    uring_release();
+    return NULL;
+}
+
+/* Both the read-ahead window and the children budget hold one fd per
+ * directory; keep them well inside RLIMIT_NOFILE. */
+void walk_limits_configure(int nthreads) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur == RLIM_INFINITY) return;
+    long avail = (long)rl.rlim_cur - 16 - nthreads;
+    if (avail < 8) avail = 8;
+    if (fd_budget > avail / 4) fd_budget = (int)(avail / 4);
+    if (ahead_max > avail / 2) ahead_max = (int)(avail / 2);
+}
 
-    for (int r = 0; r < nrows; ++r) {
-        for (int c = 0; c < ncols; ++c) {
-            int idx = r + c * nrows;
-            if (idx >= n) continue;
-            int last = (c == ncols - 1);
-            print_colored_padded(".", names[idx], colw, last);
+int pool_start(int nthreads, display_mode_t mode, int recursive) {
+    pool.mode = mode;
+    pool.recursive = recursive;
+    pool.nthreads = 0;
+    if (nthreads <= 1) return 0;
+    pool.deques = calloc(nthreads, sizeof(wsdeque_t));
+    pool.threads = calloc(nthreads, sizeof(pthread_t));
+    if (!pool.deques || !pool.threads) return -1;
+    for (int i = 0; i < nthreads; ++i) pthread_mutex_init(&pool.deques[i].lock, NULL);
+    pool.nthreads = nthreads;
+    for (int i = 0; i < nthreads; ++i) {
+        if (pthread_create(&pool.threads[i], NULL, pool_worker, (void *)(intptr_t)i) != 0) {
+            pool.nthreads = i;   /* run with the workers we got */
+            break;
         }
-        printf("\n");
     }
+    return 0;
 }
 
-void print_horizontal(const char *dirpath, char **names, int n) {
-    (void)dirpath;  // suppress unused parameter warning
-    if (n <= 0) return;
-    int maxlen = 0;
-    for (int i = 0; i < n; ++i)
-        if ((int)strlen(names[i]) > maxlen) maxlen = strlen(names[i]);
-    int colw = maxlen + 2;
-    int termw = get_term_width();
-    int cur = 0;
-    for (int i = 0; i < n; ++i) {
-        if (cur + colw > termw) {
-            printf("\n");
-            cur = 0;
+void pool_stop(void) {
+    if (pool.nthreads == 0) return;
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < pool.nthreads; ++i) pthread_join(pool.threads[i], NULL);
+    /* drop whatever is still queued */
+    for (int i = 0; i < pool.nthreads; ++i) {
+        dnode_t *nd;
+        while ((nd = wsdeque_pop(&pool.deques[i])) != NULL) dnode_unref(nd);
+        free(pool.deques[i].items);
+        pthread_mutex_destroy(&pool.deques[i].lock);
+    }
+    free(pool.deques);
+    free(pool.threads);
+    pool.nthreads = 0;
+}
+
+/* Wait until nd is scanned, scanning it on this thread if nobody has
+ * started yet so the printer never stalls behind a full queue. */
+void dnode_wait(dnode_t *nd, display_mode_t mode) {
+    if (dnode_claim(nd)) {
+        if (pool.nthreads > 0) {
+            pthread_mutex_lock(&pool.lock);
+            pool.ahead++;
+            pthread_mutex_unlock(&pool.lock);
         }
-        print_colored_padded(".", names[i], colw, 0);
-        cur += colw;
+        scan_node(nd, mode);
+        return;
     }
-    printf("\n");
+    pthread_mutex_lock(&pool.lock);
+    while (__atomic_load_n(&nd->state, __ATOMIC_ACQUIRE) != NODE_DONE)
+        pthread_cond_wait(&pool.cond, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
 }
 
-/* Long listing helpers */
-void print_permissions(mode_t mode) {
-    char perms[11];
-    perms[0] = S_ISDIR(mode) ? 'd' :
-               S_ISLNK(mode) ? 'l' :
-               S_ISCHR(mode) ? 'c' :
-               S_ISBLK(mode) ? 'b' :
-               S_ISSOCK(mode)? 's' :
-               S_ISFIFO(mode)? 'p' : '-';
-    perms[1] = (mode & S_IRUSR) ? 'r' : '-';
-    perms[2] = (mode & S_IWUSR) ? 'w' : '-';
-    perms[3] = (mode & S_IXUSR) ? ((mode & S_ISUID) ? 's' : 'x') : ((mode & S_ISUID) ? 'S' : '-');
-    perms[4] = (mode & S_IRGRP) ? 'r' : '-';
-    perms[5] = (mode & S_IWGRP) ? 'w' : '-';
-    perms[6] = (mode & S_IXGRP) ? ((mode & S_ISGID) ? 's' : 'x') : ((mode & S_ISGID) ? 'S' : '-');
-    perms[7] = (mode & S_IROTH) ? 'r' : '-';
-    perms[8] = (mode & S_IWOTH) ? 'w' : '-';
-    perms[9] = (mode & S_IXOTH) ? ((mode & S_ISVTX) ? 't' : 'x') : ((mode & S_ISVTX) ? 'T' : '-');
-    perms[10] = '\0';
-    printf("%s", perms);
+/* ---------------- recursive do_ls ---------------- */
+
+/* "path:" before a directory's listing */
+void print_dir_header(const char *path) {
+    out_str(path);
+    out_write(":\n", 2);
 }
 
-void print_long_listing(const char *dirpath) {
-    DIR *dir = opendir(dirpath);
-    if (!dir) { perror("opendir"); return; }
-    struct dirent *e;
-    struct stat st;
-    while ((e = readdir(dir)) != NULL) {
-        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
-        char full[PATH_MAX];
-        snprintf(full, sizeof(full), "%s/%s", dirpath, e->d_name);
-        if (lstat(full, &st) == -1) { perror("lstat"); continue; }
-        print_permissions(st.st_mode);
-        struct passwd *pw = getpwuid(st.st_uid);
-        struct group  *gr = getgrgid(st.st_gid);
+/* print nd once it is scanned; -1 if it could not be read */
+int emit_node(dnode_t *nd, display_mode_t mode, int header) {
+    dnode_wait(nd, mode);
 
-        char timebuf[64];
-        time_t now = time(NULL);
-        const long SIX_MONTHS = 15552000L;
-        struct tm *tm_info = localtime(&st.st_mtime);
-        if (llabs((long long)(now - st.st_mtime)) > SIX_MONTHS)
-            strftime(timebuf, sizeof(timebuf), "%b %e  %Y", tm_info);
-        else
-            strftime(timebuf, sizeof(timebuf), "%b %e %H:%M", tm_info);
-
-        printf(" %2ld %-8s %-8s %8lld %s ",
-               (long)st.st_nlink,
-               pw ? pw->pw_name : "?",
-               gr ? gr->gr_name : "?",
-               (long long)st.st_size,
-               timebuf);
+    if (header) print_dir_header(nd->path);
+    int rc = 0;
+    if (nd->err) {
+        errno = nd->err;
+        out_perror(nd->err == ENOMEM ? "malloc" : "opendir");   /* reading, not opening */
+        snapshot_store(nd->path, NULL, nd->err, !nd->parent);
+        rc = -1;
+    } else {
+        if (du_enabled) {
+            struct stat st;
+            if (!nd->parent && fstat(nd->ls.dirfd, &st) == 0) du_add_stat(&nd->du, &st);
+            du_listing(&nd->ls, &nd->du);
+        }
+        display_listing(&nd->ls, mode);
+        snapshot_store(nd->path, &nd->ls, 0, !nd->parent);
+        cache_store(&nd->ls);
+        nd->ls.dirfd = -1;   /* borrowed from the node */
+        listing_free(&nd->ls);
+        dnode_fd_put(nd);
+    }
+    if (pool.recursive) out_char('\n'); /* blank line after listing (like ls -R) */
+    if (out.interactive) out_flush();
 
-        const char *start = "";
-        if (color_enabled) start = choose_color_for(full, e->d_name);
+    if (pool.nthreads > 0) {
+        pthread_mutex_lock(&pool.lock);
+        pool.ahead--;
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return rc;
+}
 
-        if (color_enabled && start[0] != '\0') {
-            printf("%s%s%s", start, e->d_name, RESET);
+/* List the directory operands in command-line order. All of them are
+ * queued to the pool up front, so with threads they are read concurrently
+ * while the main thread prints them in order. With -R each one is walked
+ * depth first on an explicit stack: a node is printed when pushed and
+ * popped once all of its children have been visited. Otherwise a header
+ * names each directory when headers is set, with a blank line between
+ * them. Returns -1 if any directory could not be read. */
+int do_ls(char *const *dirs, int ndirs, display_mode_t mode, int nthreads,
+          int recursive, int headers) {
+    dnode_t **roots = calloc(ndirs, sizeof(dnode_t *));
+    int cap = 64, sp = 0, rc = 0;
+    struct frame { dnode_t *nd; int next; } *stack = malloc(sizeof(*stack) * cap);
+    if (!roots || !stack) { perror("do_ls"); free(roots); free(stack); return -1; }
+    for (int i = 0; i < ndirs; ++i) {
+        char *path = strdup(dirs[i]);
+        roots[i] = path ? dnode_new(NULL, path) : NULL;
+        if (!roots[i]) {
+            perror("do_ls");
+            while (i-- > 0) dnode_unref(roots[i]);
+            free(roots);
+            free(stack);
+            return -1;
+        }
+    }
+    walk_limits_configure(nthreads);
+    if (pool_start(nthreads, mode, recursive) == -1) perror("pool_start");
+    pool_offer(roots, ndirs);
+
+    int r = 0;
+    for (; r < ndirs; ++r) {
+        if (!recursive && r > 0) out_char('\n');
+        if (emit_node(roots[r], mode, recursive || headers) == -1) rc = -1;
+        stack[sp++] = (struct frame){ roots[r], 0 };
+        while (sp > 0) {
+            struct frame *f = &stack[sp - 1];
+            if (f->next == f->nd->nkids) {
+                if (sp > 1) du_merge(&stack[sp - 2].nd->du, &f->nd->du);
+                else du_merge(&du_grand, &f->nd->du);
+                if (du_enabled && recursive && sp == 1 && ndirs > 1) {
+                    out_str(f->nd->path);
+                    du_print(":", &f->nd->du);
+                    out_char('\n');
+                }
+                dnode_unref(f->nd);
+                sp--;
+                continue;
+            }
+            dnode_t *kid = f->nd->kids[f->next++];
+            if (sp == cap) {
+                void *tmp = realloc(stack, sizeof(*stack) * (cap *= 2));
+                if (!tmp) { perror("do_ls"); rc = -1; break; }
+                stack = tmp;
+            }
+            if (emit_node(kid, mode, 1) == -1) rc = -1;
+            stack[sp++] = (struct frame){ kid, 0 };
+        }
+        if (sp > 0) break;   /* out of memory */
+    }
+
+    pool_stop();
+    while (sp > 0) dnode_unref(stack[--sp].nd);
+    while (++r < ndirs) dnode_unref(roots[r]);   /* never reached */
+    if (du_enabled) {
+        if (!recursive) out_char('\n');
+        du_print("grand total", &du_grand);
+    }
+    free(roots);
+    free(stack);
+    return rc;
+}
+
+/* ---------------- snapshot listing ---------------- */
+
+/* directories of the snapshot listing under d, in display order */
+int snapshot_emit(const snapshot_t *s, long di, display_mode_t mode, int header,
+                  int recursive, long **kids, int *nkids) {
+    const snap_dir_t *d = &s->dirs[di];
+    const char *path = SNAP_STR(s, d->path_off);
+    *kids = NULL;
+    *nkids = 0;
+    if (header) print_dir_header(path);
+    int rc = 0;
+    listing_t ls;
+    if (d->err) {
+        errno = d->err;
+        out_perror("opendir");
+        rc = -1;
+    } else if (snapshot_listing(s, d, &ls) == -1) {
+        out_perror(path);
+        rc = -1;
+    } else {
+        listing_sort(&ls);
+        display_listing(&ls, mode);
+        if (recursive && ls.n > 0) *kids = malloc(sizeof(long) * ls.n);
+        for (int i = 0; *kids && i < ls.n; ++i) {
+            entry_t *e = &ls.ents[i];
+            if (e->type != DT_DIR) continue;
+            char *kpath = path_join(path, ENT_NAME(&ls, e));
+            long k = kpath ? snapshot_find(s, kpath) : -1;
+            if (k != -1) (*kids)[(*nkids)++] = k;   /* not recorded without -R */
+            free(kpath);
+        }
+        listing_free(&ls);
+    }
+    if (recursive) out_char('\n');
+    return rc;
+}
+
+/* do_ls() over a snapshot: the operands are looked up by the path they
+ * were listed under, the snapshot's own operands when none are given */
+int snapshot_ls(const char *file, char *const *ops, int nops, display_mode_t mode,
+                int recursive) {
+    snapshot_t s;
+    if (snapshot_load(&s, file) == -1) { perror(file); return -1; }
+    long *roots = malloc(sizeof(long) * (nops ? (size_t)nops : s.ndirs ? s.ndirs : 1));
+    int nroots = 0, rc = 0;
+    if (!roots) { perror("snapshot_ls"); snapshot_close(&s); return -1; }
+    for (int i = 0; i < nops; ++i) {
+        long di = snapshot_find(&s, ops[i]);
+        if (di == -1) {
+            fprintf(stderr, "%s: not in snapshot %s\n", ops[i], file);
+            rc = -1;
         } else {
-            printf("%s", e->d_name);
+            roots[nroots++] = di;
         }
+    }
+    for (uint64_t i = 0; !nops && i < s.ndirs; ++i)
+        if (s.dirs[i].flags & SNAPDIR_ROOT) roots[nroots++] = (long)i;
 
-        if (S_ISLNK(st.st_mode)) {
-            char link_target[PATH_MAX];
-            ssize_t len = readlink(full, link_target, sizeof(link_target)-1);
-            if (len != -1) {
-                link_target[len] = '\0';
-                printf(" -> %s", link_target);
+    int cap = 64, sp = 0;
+    struct frame { long *kids; int nkids, next; } *stack = malloc(sizeof(*stack) * cap);
+    if (!stack) { perror("snapshot_ls"); free(roots); snapshot_close(&s); return -1; }
+    for (int r = 0; r < nroots; ++r) {
+        if (!recursive && r > 0) out_char('\n');
+        struct frame f = { NULL, 0, 0 };
+        if (snapshot_emit(&s, roots[r], mode, recursive || nroots > 1 || nops > 1,
+                          recursive, &f.kids, &f.nkids) == -1) rc = -1;
+        stack[sp++] = f;
+        while (sp > 0) {
+            struct frame *top = &stack[sp - 1];
+            if (top->next == top->nkids) {
+                free(top->kids);
+                sp--;
+                continue;
+            }
+            long k = top->kids[top->next++];
+            if (sp == cap) {
+                void *tmp = realloc(stack, sizeof(*stack) * (cap *= 2));
+                if (!tmp) { perror("snapshot_ls"); rc = -1; break; }
+                stack = tmp;
             }
+            f = (struct frame){ NULL, 0, 0 };
+            if (snapshot_emit(&s, k, mode, 1, recursive, &f.kids, &f.nkids) == -1) rc = -1;
+            stack[sp++] = f;
         }
-        printf("\n");
+        if (sp > 0) break;   /* out of memory */
     }
-    closedir(dir);
+    while (sp > 0) free(stack[--sp].kids);
+    free(stack);
+    free(roots);
+    snapshot_close(&s);
+    return rc;
 }
 
-/* ---------------- recursive do_ls ---------------- */
+/* ---------------- snapshot diff ---------------- */
 
-typedef enum { MODE_DEFAULT=0, MODE_LONG=1, MODE_HORIZONTAL=2 } display_mode_t;
+/* --diff=FILE walks the live tree under each operand (the snapshot's own
+ * roots when none are given) and prints what changed since FILE was
+ * written, one line per entry, depth first in name order:
+ *
+ *   A path   added        D path   removed        M path   modified
+ *
+ * with a '/' after directories. An entry replaced by one of another type
+ * is reported as removed and added. Everything under an added or removed
+ * directory is reported too.
+ *
+ * A directory whose dev, ino, mtime and ctime match the snapshot has the
+ * same entries as when it was recorded, so it is not read again: only its
+ * subdirectories are visited, one fstatat() each. Like --cache this misses
+ * files modified in place inside such a directory, whose times are only
+ * kept in the directory's own entry; what it costs is one stat per
+ * directory plus work proportional to the directories that changed.
+ * Subdirectories a snapshot taken without -R did not record are skipped. */
+typedef struct {
+    char       *path;
+    long        di;        /* snapshot directory, -1 if not recorded */
+    int         gone;      /* removed: report what the snapshot holds */
+    int         have_st;
+    struct stat st;        /* live metadata when have_st */
+} diff_frame_t;
 
-void do_ls(const char *dirname, display_mode_t mode, int recursive_flag) {
-    /* Print header like `ls -R` does */
-    printf("%s:\n", dirname);
+typedef struct {
+    diff_frame_t *f;
+    size_t        n, cap;
+} diff_frames_t;
 
-    /* Read and sort names */
-    int n = 0;
-    char **names = read_dir_names(dirname, &n);
-    if (!names) {
-        printf("\n"); /* keep spacing similar to ls output when unreadable */
-        return;
+int diff_push(diff_frames_t *fs, char *path, long di, int gone, const struct stat *st) {
+    if (!path) return -1;
+    if (fs->n == fs->cap) {
+        size_t cap = fs->cap ? fs->cap * 2 : 64;
+        diff_frame_t *tmp = realloc(fs->f, sizeof(diff_frame_t) * cap);
+        if (!tmp) { free(path); return -1; }
+        fs->f = tmp;
+        fs->cap = cap;
     }
-    qsort(names, n, sizeof(char*), cmpstr_qsort);
+    diff_frame_t *f = &fs->f[fs->n++];
+    f->path = path;
+    f->di = di;
+    f->gone = gone;
+    f->have_st = st != NULL;
+    if (st) f->st = *st;
+    return 0;
+}
 
-    /* Display based on mode */
-    if (mode == MODE_LONG) {
-        print_long_listing(dirname);
-    } else if (mode == MODE_HORIZONTAL) {
-        print_horizontal(dirname, names, n);
+void diff_report(char tag, const char *path, int is_dir) {
+    out_char(tag);
+    out_char(' ');
+    out_str(path);
+    if (is_dir) out_char('/');
+    out_char('\n');
+}
+
+/* same directory, and no entry added, removed or renamed since */
+int diff_dir_unchanged(const snap_dir_t *d, const struct stat *st) {
+    return d->err == 0 && d->dev == (uint64_t)st->st_dev && d->ino == (uint64_t)st->st_ino &&
+           d->mtime == st->st_mtim.tv_sec && d->mtime_nsec == (uint32_t)st->st_mtim.tv_nsec &&
+           d->ctime == st->st_ctim.tv_sec && d->ctime_nsec == (uint32_t)st->st_ctim.tv_nsec;
+}
+
+/* a directory's times change with its contents, so only its own mode and
+ * owner count for it */
+int diff_modified(const struct stat *old, const struct stat *cur) {
+    if (old->st_mode != cur->st_mode || old->st_uid != cur->st_uid || old->st_gid != cur->st_gid)
+        return 1;
+    if (S_ISDIR(cur->st_mode)) return 0;
+    return old->st_ino != cur->st_ino || old->st_size != cur->st_size ||
+           old->st_mtim.tv_sec != cur->st_mtim.tv_sec ||
+           old->st_mtim.tv_nsec != cur->st_mtim.tv_nsec ||
+           old->st_ctim.tv_sec != cur->st_ctim.tv_sec ||
+           old->st_ctim.tv_nsec != cur->st_ctim.tv_nsec;
+}
+
+/* the recorded entries of d in name order, only its subdirectories if
+ * dirs_only */
+int diff_snapshot_listing(const snapshot_t *s, long di, int dirs_only, listing_t *ls) {
+    listing_init(ls);
+    if (di == -1 || s->dirs[di].err) return 0;
+    const snap_dir_t *d = &s->dirs[di];
+    if (!dirs_only) {
+        if (snapshot_listing(s, d, ls) == -1) return -1;
     } else {
-        print_columns_down_across(dirname, names, n);
+        for (uint64_t i = 0; i < d->n; ++i) {
+            const snap_ent_t *r = &s->ents[d->first + i];
+            if (r->type == DT_DIR &&
+                listing_add(ls, SNAP_STR(s, r->name_off), r->name_len, DT_DIR) == -1) {
+                listing_free(ls);
+                return -1;
+            }
+        }
     }
-    printf("\n"); /* blank line after listing (like ls -R) */
+    listing_sort(ls);
+    return 0;
+}
 
-    /* If recursive, find subdirectories and recurse */
-    if (recursive_flag) {
-        for (int i = 0; i < n; ++i) {
-            char full[PATH_MAX];
-            if (snprintf(full, sizeof(full), "%s/%s", dirname, names[i]) >= (int)sizeof(full)) continue;
-            struct stat st;
-            if (lstat(full, &st) == -1) continue;
-            if (S_ISDIR(st.st_mode)) {
-                /* skip . and .. */
-                if (strcmp(names[i], ".") == 0 || strcmp(names[i], "..") == 0) continue;
-                /* Recurse */
-                do_ls(full, mode, recursive_flag);
+/* Compare the directory of nd with its record, reporting the differences
+ * and queueing the subdirectories to visit in kids, in name order. It is
+ * opened relative to its parent as in scan_node(), and keeps its fd for
+ * them within the same FD_BUDGET. */
+int diff_dir(const snapshot_t *s, dnode_t *nd, diff_frame_t *f, diff_frames_t *kids) {
+    listing_t cur, old;
+    listing_init(&cur);
+    listing_init(&old);
+    int fd = -1, unchanged = 0;
+    if (!f->gone) {
+        dnode_t *p = nd->parent;
+        const char *name = p ? nd->name : nd->path;
+        int pfd = !p ? AT_FDCWD : p->kids_hold ? p->fd : dnode_reopen(p);
+        int err = 0;
+        if (pfd == -1) err = errno;
+        if (!err && !f->have_st) {
+            /* operands are followed like do_ls() roots */
+            STAT_ADD(stats, 1);
+            if (fstatat(pfd, name, &f->st, p ? AT_SYMLINK_NOFOLLOW : 0) == 0) f->have_st = 1;
+            else err = errno;
+        }
+        if (!err) unchanged = f->di != -1 && diff_dir_unchanged(&s->dirs[f->di], &f->st);
+        if (!err && unchanged) {
+            STAT_ADD(pruned, 1);
+            if (diff_snapshot_listing(s, f->di, 1, &old) == -1) err = errno;
+            for (int j = 0; !err && j < old.n; ++j) {
+                char *path = path_join(nd->path, ENT_NAME(&old, &old.ents[j]));
+                long ki = path ? snapshot_find(s, path) : -1;
+                if (path && ki == -1) { free(path); continue; }   /* not recorded without -R */
+                if (diff_push(kids, path, ki, 0, NULL) == -1) err = ENOMEM;
+            }
+            if (!err && kids->n > 0) {
+                fd = openat(pfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                STAT_ADD(opens, 1);   /* failing is fine: the kids reopen it */
+            }
+        } else if (!err) {
+            if (read_listing_at(pfd, name, &cur) == -1) err = errno;
+        }
+        if (p && p->kids_hold) dnode_fd_put(p);
+        else if (p && pfd != -1) close(pfd);
+        if (err == ENOENT && !f->have_st && f->di != -1) {
+            diff_report('D', nd->path, 1);   /* vanished since it was listed */
+            f->gone = 1;
+        } else if (err) {
+            listing_free(&old);
+            errno = err;
+            return -1;
+        }
+    }
+
+    if (f->gone) {
+        if (diff_snapshot_listing(s, f->di, 0, &old) == -1) return -1;
+        for (int j = 0; j < old.n; ++j) {
+            entry_t *o = &old.ents[j];
+            char *path = path_join(nd->path, ENT_NAME(&old, o));
+            if (!path) goto fail;
+            diff_report('D', path, o->type == DT_DIR);
+            if (o->type != DT_DIR) { free(path); continue; }
+            if (diff_push(kids, path, snapshot_find(s, path), 1, NULL) == -1) goto fail;
+        }
+        listing_free(&old);
+        return 0;
+    }
+
+    if (!unchanged) {
+        listing_prefetch(&cur, MODE_LONG);
+        listing_sort(&cur);
+        if (diff_snapshot_listing(s, f->di, 0, &old) == -1) goto fail;
+    }
+    int i = 0, j = 0;
+    while (!unchanged && (i < cur.n || j < old.n)) {
+        entry_t *c = i < cur.n ? &cur.ents[i] : NULL;
+        entry_t *o = j < old.n ? &old.ents[j] : NULL;
+        int cmp = !c ? 1 : !o ? -1 : strcmp(ENT_NAME(&cur, c), ENT_NAME(&old, o));
+        const struct stat *cst = c && cmp <= 0 ? entry_stat(&cur, c) : NULL;
+        const struct stat *ost = o && cmp >= 0 && (o->flags & ENT_HAVE_STAT) ? ENT_STAT(&old, o) : NULL;
+        if (cmp == 0 && c->type != o->type) {
+            /* replaced by another type: removed, then added */
+            char *path = path_join(nd->path, ENT_NAME(&old, o));
+            if (!path) goto fail;
+            diff_report('D', path, o->type == DT_DIR);
+            if (o->type == DT_DIR) {
+                if (diff_push(kids, path, snapshot_find(s, path), 1, NULL) == -1) goto fail;
+            } else {
+                free(path);
             }
+            j++;
+            continue;
+        }
+        const char *name = cmp <= 0 ? ENT_NAME(&cur, c) : ENT_NAME(&old, o);
+        char *path = path_join(nd->path, name);
+        if (!path) goto fail;
+        int is_dir = (cmp <= 0 ? c : o)->type == DT_DIR;
+        if (cmp < 0) diff_report('A', path, is_dir);
+        else if (cmp > 0) diff_report('D', path, is_dir);
+        else if (cst && ost && diff_modified(ost, cst)) diff_report('M', path, is_dir);
+        /* descend into added directories and recorded ones; the others
+         * were not recorded because the snapshot was taken without -R */
+        long ki = is_dir && cmp >= 0 ? snapshot_find(s, path) : -1;
+        if (is_dir && (cmp < 0 || ki != -1)) {
+            if (diff_push(kids, path, ki, cmp > 0, cst) == -1) goto fail;
+        } else {
+            free(path);
+        }
+        if (cmp <= 0) i++;
+        if (cmp >= 0) j++;
+    }
+    if (!unchanged) {
+        fd = cur.dirfd;
+        cur.dirfd = -1;
+    }
+    listing_free(&cur);
+    listing_free(&old);
+
+    int users = 0;
+    for (size_t k = 0; k < kids->n; ++k) users += !kids->f[k].gone;
+    if (users > 0 && fd != -1) {
+        pthread_mutex_lock(&fd_lock);
+        if (fds_held < fd_budget) {
+            fds_held++;
+            nd->kids_hold = 1;
+            nd->fd = fd;
+            nd->fd_users = users;
+            fd = -1;
+        }
+        pthread_mutex_unlock(&fd_lock);
+    }
+    if (fd != -1) close(fd);
+    return 0;
+
+fail:
+    listing_free(&cur);
+    listing_free(&old);
+    errno = ENOMEM;
+    return -1;
+}
+
+/* Walk the operands depth first against the snapshot in FILE; -1 if
+ * anything could not be compared. As in do_ls(), a directory stays on
+ * the stack, with its fd, until its subdirectories have been visited. */
+int snapshot_diff(const char *file, char *const *ops, int nops) {
+    snapshot_t s;
+    if (snapshot_load(&s, file) == -1) { perror(file); return -1; }
+    diff_frames_t roots = { 0 };
+    int rc = 0;
+    for (int i = 0; i < nops; ++i) {
+        long di = snapshot_find(&s, ops[i]);
+        if (di == -1) {
+            fprintf(stderr, "%s: not in snapshot %s\n", ops[i], file);
+            rc = -1;
+        } else if (diff_push(&roots, strdup(ops[i]), di, 0, NULL) == -1) {
+            rc = -1;
         }
     }
+    for (uint64_t i = 0; !nops && i < s.ndirs; ++i)
+        if ((s.dirs[i].flags & SNAPDIR_ROOT) &&
+            diff_push(&roots, strdup(SNAP_STR(&s, s.dirs[i].path_off)), (long)i, 0, NULL) == -1)
+            rc = -1;
+    walk_limits_configure(0);
 
-    free_names(names, n);
+    int cap = 64, sp = 0;
+    struct frame { dnode_t *nd; diff_frames_t kids; size_t next; } *stack = malloc(sizeof(*stack) * cap);
+    if (!stack) { perror("snapshot_diff"); rc = -1; }
+    for (size_t r = 0; stack && r < roots.n; ++r) {
+        diff_frame_t f = roots.f[r];
+        roots.f[r].path = NULL;
+        dnode_t *parent = NULL;
+        while (1) {
+            dnode_t *nd = dnode_new(parent, f.path);
+            struct frame fr = { nd, { 0 }, 0 };
+            if (!nd) {
+                if (parent && parent->kids_hold && !f.gone) dnode_fd_put(parent);
+                out_perror("snapshot_diff");
+                rc = -1;
+            } else if (diff_dir(&s, nd, &f, &fr.kids) == -1) {
+                out_perror(nd->path);
+                rc = -1;
+            }
+            if (out.interactive) out_flush();
+            if (nd) {
+                if (sp == cap) {
+                    void *tmp = realloc(stack, sizeof(*stack) * (cap *= 2));
+                    if (!tmp) {
+                        perror("snapshot_diff");
+                        for (size_t k = 0; k < fr.kids.n; ++k) free(fr.kids.f[k].path);
+                        free(fr.kids.f);
+                        dnode_unref(nd);
+                        rc = -1;
+                        break;
+                    }
+                    stack = tmp;
+                }
+                stack[sp++] = fr;
+            }
+            /* next subdirectory to visit, popping finished directories */
+            while (sp > 0 && stack[sp - 1].next == stack[sp - 1].kids.n) {
+                free(stack[sp - 1].kids.f);
+                dnode_unref(stack[--sp].nd);
+            }
+            if (sp == 0) break;
+            struct frame *top = &stack[sp - 1];
+            f = top->kids.f[top->next];
+            top->kids.f[top->next++].path = NULL;
+            parent = top->nd;
+        }
+        if (sp > 0) break;   /* out of memory */
+    }
+    while (sp > 0) {
+        struct frame *top = &stack[--sp];
+        for (size_t k = top->next; k < top->kids.n; ++k) free(top->kids.f[k].path);
+        free(top->kids.f);
+        dnode_unref(top->nd);
+    }
+    for (size_t r = 0; r < roots.n; ++r) free(roots.f[r].path);
+    free(roots.f);
+    free(stack);
+    snapshot_close(&s);
+    return rc;
 }
 
 /* ---------------- main & dispatch ---------------- */
 
+/* long-only options get values outside the char range */
+enum { OPT_STATS = 256, OPT_COLLATE, OPT_HEAD, OPT_MEM_BUDGET, OPT_NO_EXEC_COLOR, OPT_CACHE,
+       OPT_SNAPSHOT, OPT_WRITE_SNAPSHOT, OPT_DIFF };
+
 int main(int argc, char *argv[]) {
-    color_enabled = isatty(STDOUT_FILENO); /* only colorize when stdout is a terminal */
+    out.interactive = isatty(STDOUT_FILENO);
+    color_enabled = out.interactive; /* only colorize when stdout is a terminal */
+    if (color_enabled) colors_init();
+    dirbuf_configure();
+    fetch_configure();
+    time_init();
 
     display_mode_t mode = MODE_DEFAULT;
-    const char *path = ".";
     int opt;
     int recursive_flag = 0;
-    while ((opt = getopt(argc, argv, "lxR")) != -1) {
+    int nthreads = 1, threads_set = 0;
+    int no_exec_color = 0;
+    const char *cache_path = NULL;
+    const char *snap_in = NULL, *snap_out_path = NULL, *diff_with = NULL;
+    static const struct option long_opts[] = {
+        { "threads", required_argument, NULL, 'j' },
+        { "numeric-uid-gid", no_argument, NULL, 'n' },
+        { "du", no_argument, NULL, 's' },
+        { "collate", no_argument, NULL, OPT_COLLATE },
+        { "head", required_argument, NULL, OPT_HEAD },
+        { "mem-budget", required_argument, NULL, OPT_MEM_BUDGET },
+        { "no-exec-color", no_argument, NULL, OPT_NO_EXEC_COLOR },
+        { "cache", required_argument, NULL, OPT_CACHE },
+        { "snapshot", required_argument, NULL, OPT_SNAPSHOT },
+        { "write-snapshot", required_argument, NULL, OPT_WRITE_SNAPSHOT },
+        { "diff", required_argument, NULL, OPT_DIFF },
+        { "stats", no_argument, NULL, OPT_STATS },
+        { NULL, 0, NULL, 0 }
+    };
+    while ((opt = getopt_long(argc, argv, "1flnxRrsStUj:", long_opts, NULL)) != -1) {
         switch (opt) {
             case 'l': mode = MODE_LONG; break;
+            case 'n': mode = MODE_LONG; numeric_ids = 1; break;
             case 'x': if (mode != MODE_LONG) mode = MODE_HORIZONTAL; break;
+            case '1': if (mode != MODE_LONG) mode = MODE_ONE; break;
+            case 'f':
+            case 'U': sort_by = SORT_NONE; break;
             case 'R': recursive_flag = 1; break;
+            case 'r': sort_reverse = 1; break;
+            case 's': du_enabled = 1; break;
+            case 'S': sort_by = SORT_SIZE; break;
+            case 't': sort_by = SORT_TIME; break;
+            case 'j':
+                nthreads = atoi(optarg);
+                threads_set = 1;
+                if (nthreads < 1 || nthreads > THREADS_MAX) {
+                    fprintf(stderr, "%s: invalid thread count '%s'\n", argv[0], optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_STATS: stats_enabled = 1; break;
+            case OPT_NO_EXEC_COLOR: no_exec_color = 1; break;
+            case OPT_CACHE: cache_path = optarg; break;
+            case OPT_SNAPSHOT: snap_in = optarg; break;
+            case OPT_WRITE_SNAPSHOT: snap_out_path = optarg; break;
+            case OPT_DIFF: diff_with = optarg; break;
+            case OPT_HEAD: {
+                char *end;
+                unsigned long v = strtoul(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || v == 0 || v > INT_MAX / 2) {
+                    fprintf(stderr, "%s: invalid --head count '%s'\n", argv[0], optarg);
+                    return EXIT_FAILURE;
+                }
+                head_limit = v;
+                break;
+            }
+            case OPT_MEM_BUDGET:
+                mem_budget = parse_size(optarg);
+                if (mem_budget == 0) {
+                    fprintf(stderr, "%s: invalid --mem-budget size '%s'\n", argv[0], optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_COLLATE:
+                collate_enabled = 1;
+                setlocale(LC_COLLATE, "");
+                break;
             default:
-                fprintf(stderr, "Usage: %s [-l] [-x] [-R] [directory]\n", argv[0]);
+                fprintf(stderr, "Usage: %s [-1] [-l] [-n] [-x] [-R] [-r] [-s|--du] [-S] [-t] [-U|-f] [-j N] [--head=N] [--mem-budget=SIZE] [--no-exec-color] [--cache=FILE] [--snapshot=FILE] [--write-snapshot=FILE] [--diff=FILE] [--collate] [--stats] [file...]\n", argv[0]);
                 return EXIT_FAILURE;
         }
     }
-    if (optind < argc) path = argv[optind];
-
-    /* If recursive_flag is set, use do_ls which handles recursion */
-    if (recursive_flag) {
-        do_ls(path, mode, recursive_flag);
-        return EXIT_SUCCESS;
+    if (color_enabled) color_configure(no_exec_color);
+    if (mode == MODE_LONG) meta_mask = STATX_BASIC_STATS;
+    if (sort_by == SORT_SIZE) meta_mask |= STATX_SIZE;
+    if (sort_by == SORT_TIME) meta_mask |= STATX_MTIME;
+    if (du_enabled) meta_mask |= STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_INO |
+                                 STATX_SIZE | STATX_BLOCKS;
+    if (du_enabled && head_limit) {
+        /* the totals would only count the entries --head keeps */
+        fprintf(stderr, "%s: --du cannot be combined with --head\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (mem_budget && !head_limit && (recursive_flag || du_enabled || snap_out_path)) {
+        /* the walk keeps whole listings in memory, so it cannot honor one */
+        fprintf(stderr, "%s: --mem-budget cannot be combined with -R, --du or --write-snapshot\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+    /* everything but unsorted streaming and --mem-budget goes through do_ls() */
+    int walk = recursive_flag || du_enabled || snap_out_path ||
+               (sort_by != SORT_NONE && !(mem_budget && !head_limit));
+    if (cache_path && !walk) {
+        fprintf(stderr, "%s: --cache cannot be combined with -U or --mem-budget without -R\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (cache_path && head_limit) {
+        /* --head listings keep only part of each directory */
+        fprintf(stderr, "%s: --cache cannot be combined with --head\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if ((snap_in || snap_out_path || diff_with) && (head_limit || du_enabled)) {
+        fprintf(stderr, "%s: snapshots cannot be combined with --head or --du\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (diff_with) {
+        /* compared in byte order of names, whatever the sort options */
+        meta_mask = STATX_BASIC_STATS;
+        sort_by = SORT_NAME;
+        sort_reverse = 0;
+        collate_enabled = 0;
+        int rc = snapshot_diff(diff_with, argv + optind, argc - optind);
+        out_flush();
+        if (stats_enabled) print_stats();
+        return rc == -1 || out.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (snap_in) {
+        int rc = snapshot_ls(snap_in, argv + optind, argc - optind, mode, recursive_flag);
+        out_flush();
+        if (stats_enabled) print_stats();
+        return rc == -1 || out.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (snap_out_path) {
+        meta_mask = STATX_BASIC_STATS;
+        meta_all = 1;
     }
 
-    /* Non-recursive path: read names and dispatch as before */
-    int n = 0;
-    char **names = read_dir_names(path, &n);
-    if (!names) return EXIT_FAILURE;
-
-    qsort(names, n, sizeof(char*), cmpstr_qsort);
+    /* Operands that are not directories are listed first, together, then
+     * each directory in command-line order. Symlinks to directories are
+     * followed except with -l, as in GNU ls. */
+    static char *const dot[] = { "." };
+    char *const *ops = optind < argc ? argv + optind : dot;
+    int nops = optind < argc ? argc - optind : 1;
+    char **dirs = malloc(sizeof(char *) * nops);
+    if (!dirs) { perror("malloc"); return EXIT_FAILURE; }
+    int ndirs = 0, status = EXIT_SUCCESS;
+    listing_t files;
+    listing_init(&files);
+    for (int i = 0; i < nops; ++i) {
+        struct stat st;
+        int r = mode == MODE_LONG ? -1 : stat(ops[i], &st);
+        if (r == -1) r = lstat(ops[i], &st);
+        STAT_ADD(stats, 1);
+        if (r == -1) {
+            perror(ops[i]);
+            status = EXIT_FAILURE;
+        } else if (S_ISDIR(st.st_mode)) {
+            dirs[ndirs++] = ops[i];
+        } else if (listing_add(&files, ops[i], strlen(ops[i]), IFTODT(st.st_mode)) == 0) {
+            entry_t *e = &files.ents[files.n - 1];
+            if (listing_st_reserve(&files, e->slot) == 0) {
+                *ENT_STAT(&files, e) = st;
+                e->flags |= ENT_HAVE_STAT;
+            }
+        }
+    }
+    if (files.n > 0) {
+        files.dirfd = AT_FDCWD;   /* names are paths; readlink needs this */
+        display_listing(&files, mode);
+        if (ndirs > 0) out_char('\n');
+    }
+    int headers = nops > 1;
 
-    if (mode == MODE_LONG) {
-        print_long_listing(path);
-    } else if (mode == MODE_HORIZONTAL) {
-        print_horizontal(path, names, n);
+    if (walk) {
+        /* several directories are read concurrently unless -j says otherwise */
+        if (!threads_set && !recursive_flag && ndirs > 1)
+            nthreads = ndirs < OPERAND_THREADS ? ndirs : OPERAND_THREADS;
+        if (cache_path) cache_open(cache_path);
+        if (snap_out_path) snapshot_open_out(snap_out_path);
+        if (ndirs > 0 && do_ls(dirs, ndirs, mode, nthreads, recursive_flag, headers) == -1)
+            status = EXIT_FAILURE;
+        cache_finish();
+        if (snapshot_finish() == -1) status = EXIT_FAILURE;
     } else {
-        print_columns_down_across(path, names, n);
+        /* unsorted streaming and --mem-budget read one directory at a time */
+        for (int i = 0; i < ndirs; ++i) {
+            if (i > 0) out_char('\n');
+            if (headers) print_dir_header(dirs[i]);
+            int rc;
+            if (sort_by == SORT_NONE) {
+                rc = stream_listing(dirs[i], mode);
+                if (rc == -1) out_perror("opendir");
+            } else {
+                rc = budget_listing(dirs[i], mode);
+            }
+            if (rc == -1) status = EXIT_FAILURE;
+        }
     }
 
-    free_names(names, n);
-    return EXIT_SUCCESS;
+    files.dirfd = -1;
+    listing_free(&files);
+    free(dirs);
+    out_flush();
+    if (stats_enabled) print_stats();
+    return out.failed ? EXIT_FAILURE : status;
 }